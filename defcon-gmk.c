@@ -0,0 +1,285 @@
+/*
+ * Copyright (c) 2021, Kirill GPRB
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * GNU make plugin: resolves the definitions inside make instead of
+ * including a makefile generated by defcon, so there's no extra
+ * process and no restart when it changes.
+ *
+ *   load defcon.so
+ *   $(defcon-resolve <definitions>[,<input file>[,<prefix>]])
+ *   $(defcon-get <name>)
+ *
+ * defcon-resolve defines the same variables the -M makefile would
+ * and expands to nothing. Resolutions are kept for the rest of the
+ * run, resolving the same arguments again only parses the files
+ * that changed. defcon-get expands to the value of a definition as
+ * of the last defcon-resolve.
+ */
+
+/* Require POSIX.1-2008 */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <gnumake.h>
+
+#include "defcon.h"
+
+/* make refuses to load anything without it */
+int plugin_is_GPL_compatible;
+
+struct resolution {
+    char *args;
+    char *input_filename;
+    struct stat input_st;
+    struct defcon *ctx;
+};
+
+static struct resolution *resolutions = NULL;
+static size_t num_resolutions = 0;
+static struct resolution *last_resolution = NULL;
+
+static void *safe_realloc(void *block, size_t size)
+{
+    void *new_block = realloc(block, size);
+    if(!new_block)
+        abort();
+    return new_block;
+}
+
+static unsigned int default_num_threads(void)
+{
+#ifdef _SC_NPROCESSORS_ONLN
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    if(n > 0)
+        return (unsigned int)n;
+#endif
+    return 1;
+}
+
+static void print_warning(void *data, const char *message)
+{
+    (void)data;
+    fprintf(stderr, "%s\n", message);
+}
+
+static bool stat_changed(const struct stat *a, const struct stat *b)
+{
+    return a->st_dev != b->st_dev || a->st_ino != b->st_ino || a->st_size != b->st_size ||
+        a->st_mtim.tv_sec != b->st_mtim.tv_sec || a->st_mtim.tv_nsec != b->st_mtim.tv_nsec ||
+        a->st_ctim.tv_sec != b->st_ctim.tv_sec || a->st_ctim.tv_nsec != b->st_ctim.tv_nsec;
+}
+
+/* Stops make with the message; it goes through $(error) so
+ * the dollar signs in it need escaping */
+static char *fail(const char *func, const char *message)
+{
+    struct defcon_buffer sb = { 0 };
+
+    defcon_buffer_printf(&sb, "$(error %s: ", func);
+    for(; *message; message++) {
+        if(*message == '$')
+            defcon_buffer_putc(&sb, '$');
+        defcon_buffer_putc(&sb, *message);
+    }
+    defcon_buffer_putc(&sb, ')');
+
+    gmk_eval(sb.data, NULL);
+    defcon_buffer_free(&sb);
+    return NULL;
+}
+
+/* make keeps whitespace after commas */
+static char *trim(char *s)
+{
+    char *end;
+    while(*s == ' ' || *s == '\t')
+        s++;
+    end = s + strlen(s);
+    while(end > s && (end[-1] == ' ' || end[-1] == '\t'))
+        end--;
+    *end = 0;
+    return s;
+}
+
+/* The definitions argument is a whitespace-separated list, like
+ * the arguments to the defcon command would be */
+static int set_inputs(struct defcon *ctx, const char *definitions)
+{
+    int result;
+    char *words, *word;
+    char **args = NULL;
+    size_t num_args = 0;
+
+    words = safe_realloc(NULL, strlen(definitions) + 1);
+    strcpy(words, definitions);
+
+    for(word = strtok(words, " \t\n"); word; word = strtok(NULL, " \t\n")) {
+        args = safe_realloc(args, (num_args + 1) * sizeof(char *));
+        args[num_args++] = word;
+    }
+
+    result = defcon_set_inputs(ctx, args, num_args);
+    free(args);
+    free(words);
+    return result;
+}
+
+static struct resolution *find_resolution(const char *args)
+{
+    size_t i;
+    for(i = 0; i < num_resolutions; i++) {
+        if(!strcmp(resolutions[i].args, args))
+            return &resolutions[i];
+    }
+    return NULL;
+}
+
+static struct resolution *add_resolution(const char *args, const char *definitions, const char *input_filename, const char *prefix)
+{
+    struct defcon *ctx = defcon_create();
+    struct resolution *res = NULL;
+
+    defcon_set_warning_handler(ctx, &print_warning, NULL);
+    defcon_set_threads(ctx, default_num_threads());
+    if(*prefix)
+        defcon_set_prefix(ctx, prefix);
+
+    if(set_inputs(ctx, definitions) != DEFCON_OK || defcon_load(ctx, input_filename, DEFCON_KEEP_FILES) != DEFCON_OK) {
+        fail("defcon-resolve", defcon_error_message(ctx));
+        defcon_destroy(ctx);
+        return NULL;
+    }
+
+    resolutions = safe_realloc(resolutions, (num_resolutions + 1) * sizeof(struct resolution));
+    res = &resolutions[num_resolutions++];
+    res->args = safe_realloc(NULL, strlen(args) + 1);
+    strcpy(res->args, args);
+    res->input_filename = safe_realloc(NULL, strlen(input_filename) + 1);
+    strcpy(res->input_filename, input_filename);
+    memset(&res->input_st, 0, sizeof(res->input_st));
+    res->ctx = ctx;
+
+    /* Fresh tables have nothing applied, so stat() is left
+     * out and the input file counts as changed */
+    res->input_st.st_ino = (ino_t)-1;
+    return res;
+}
+
+/* Brings a resolution up to date; definitions and the input file
+ * are only read again when they changed since the last time */
+static bool update_resolution(struct resolution *res)
+{
+    bool defs_changed = false;
+    struct stat st;
+
+    if(defcon_reload(res->ctx, &defs_changed) != DEFCON_OK) {
+        fail("defcon-resolve", defcon_error_message(res->ctx));
+        return false;
+    }
+
+    if(stat(res->input_filename, &st) != 0)
+        memset(&st, 0, sizeof(st));
+    if(!defs_changed && !stat_changed(&st, &res->input_st))
+        return true;
+    res->input_st = st;
+
+    defcon_reset(res->ctx);
+    if(defcon_apply_conf(res->ctx, res->input_filename) != DEFCON_OK || defcon_check(res->ctx) != DEFCON_OK) {
+        fail("defcon-resolve", defcon_error_message(res->ctx));
+        /* Failed resolutions are retried next time */
+        memset(&res->input_st, 0, sizeof(res->input_st));
+        res->input_st.st_ino = (ino_t)-1;
+        return false;
+    }
+
+    defcon_render(res->ctx);
+    return true;
+}
+
+static char *func_resolve(const char *name, unsigned int argc, char **argv)
+{
+    const char *definitions = trim(argv[0]);
+    const char *input_filename = (argc > 1 && *trim(argv[1])) ? trim(argv[1]) : "defcon.conf";
+    const char *prefix = (argc > 2) ? trim(argv[2]) : "";
+    struct defcon_buffer args = { 0 };
+    struct defcon_buffer makefile = { 0 };
+    struct resolution *res = NULL;
+
+    /* Separated by newlines, which make won't leave in the arguments */
+    defcon_buffer_printf(&args, "%s\n%s\n%s", definitions, input_filename, prefix);
+    if(!(res = find_resolution(args.data)))
+        res = add_resolution(args.data, definitions, input_filename, prefix);
+    defcon_buffer_free(&args);
+
+    if(!res || !update_resolution(res))
+        return NULL;
+
+    defcon_format_makefile(res->ctx, &makefile);
+    if(makefile.data)
+        gmk_eval(makefile.data, NULL);
+    defcon_buffer_free(&makefile);
+
+    last_resolution = res;
+    (void)name;
+    return NULL;
+}
+
+static char *func_get(const char *name, unsigned int argc, char **argv)
+{
+    char *result = NULL;
+    struct defcon_buffer value = { 0 };
+
+    (void)argc;
+    if(!last_resolution)
+        return fail(name, "nothing resolved yet");
+
+    if(defcon_get(last_resolution->ctx, trim(argv[0]), &value) != DEFCON_OK)
+        return fail(name, defcon_error_message(last_resolution->ctx));
+
+    if(value.length) {
+        result = gmk_alloc((unsigned int)value.length + 1);
+        memcpy(result, value.data, value.length + 1);
+    }
+
+    defcon_buffer_free(&value);
+    return result;
+}
+
+int defcon_gmk_setup(const gmk_floc *floc)
+{
+    (void)floc;
+    gmk_add_function("defcon-resolve", &func_resolve, 1, 3, GMK_FUNC_DEFAULT);
+    gmk_add_function("defcon-get", &func_get, 1, 1, GMK_FUNC_DEFAULT);
+    return 1;
+}
@@ -24,13 +24,21 @@
  * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
-/* Require POSIX.2-1992 */
-#define _POSIX_C_SOURCE 2
+/* Require POSIX.1-2008 */
+#define _POSIX_C_SOURCE 200809L
+
+/* inotify for watching */
+#ifdef __linux__
+#define _DEFAULT_SOURCE
+#endif
 
-#include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <inttypes.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stddef.h>
@@ -38,298 +46,1797 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+#include "defcon.h"
+
+#define OUTPUT_C_HEADER     0
+#define OUTPUT_MAKEFILE     1
+#define OUTPUT_KEY_HEADERS  2
+#define OUTPUT_NINJA        3
+#define OUTPUT_INDEX        4
+
+/* Can't clash with a key header: keys are uppercase */
+#define KEY_HEADERS_AGGREGATE "all-keys.h"
+
+/* A burst of changes ends once it's been quiet for this long */
+#define WATCH_DEBOUNCE_MS 100
+
+/* A server client sending a longer line is disconnected */
+#define SERVER_MAX_LINE 65536
+
+/* So is one that lets more replies than this pile up unread */
+#define SERVER_MAX_OUTPUT (16 * 1024 * 1024)
+
+/* -e imports DEFCON_<KEY> variables, the key as the outputs have it */
+#define ENV_PREFIX "DEFCON_"
+
+extern char **environ;
+
+/* Outputs are written to a temporary file next to the target and
+ * only renamed into place once every output of the run is written */
+struct staged_output {
+    struct defcon_buffer filename;
+    struct defcon_buffer temp_filename;
+};
+
+struct output_job {
+    unsigned int type;
+    const char *filename;
+    bool result;
+    double milliseconds;
+};
+
+/* Output jobs only read the resolved context, so any
+ * number of them can be rendered at the same time */
+struct output_queue {
+    const struct defcon *ctx;
+    struct output_job *jobs;
+    size_t num_jobs;
+    size_t next_job;
+    const char **inputs;
+    size_t num_inputs;
+    bool write_depfiles;
+    pthread_mutex_t lock;
+};
+
+/* The keys the prerequisites of a depfile mention, by
+ * index and in the order they were first seen */
+struct key_set {
+    bool *seen;
+    size_t *keys;
+    size_t count;
+};
+
+/* Values from -D and, with -e, the environment. They go on top of
+ * the input file every time it's applied, the environment first */
+struct overrides {
+    char **defines;
+    size_t num_defines;
+    bool use_environment;
+    bool suppress_undefined;
+};
+
+/* Everything a watch or server session carries between requests;
+ * the context keeps the parsed definition files */
+struct watch_state {
+    struct defcon *ctx;
+    const struct overrides *overrides;
+    const char *input_filename;
+    struct stat input_st;
+    const char **inputs;
+    struct output_queue *outputs;
+    unsigned int num_threads;
+    int fd;
+};
+
+/* A server connection; overrides are NUL-terminated name and value
+ * pairs applied after the input file, which is the server's own
+ * unless conf names another one. Every change bumps the version */
+struct client {
+    int fd;
+    struct defcon_buffer in;
+    struct defcon_buffer out;
+    struct defcon_buffer conf;
+    struct defcon_buffer overrides;
+    unsigned long version;
+};
+
+struct server {
+    struct watch_state *session;
+    struct client *clients;
+    size_t num_clients;
+    size_t capacity;
+    const struct client *resolved_for;
+    unsigned long resolved_version;
+    bool write_depfiles;
+};
+
+static const char *argv_0 = "defcon";
+static bool update_changed_only = false;
+static bool sync_outputs = false;
+static mode_t output_mode = 0666;
+static struct staged_output *staged_outputs = NULL;
+static size_t num_staged_outputs = 0;
+static size_t staged_outputs_capacity = 0;
+static bool staging_failed = false;
+static pthread_mutex_t staging_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void die(const char *fmt, ...)
+{
+    va_list va;
+    char print_buffer[4096];
+    va_start(va, fmt);
+    vsnprintf(print_buffer, sizeof(print_buffer), fmt, va);
+    va_end(va);
+    fprintf(stderr, "%s: fatal: %s\n", argv_0, print_buffer);
+    exit(1);
+}
+
+/* Called from the output threads too; a single
+ * fprintf keeps the lines from interleaving */
+static void lprintf(const char *fmt, ...)
+{
+    va_list va;
+    char print_buffer[4096];
+    va_start(va, fmt);
+    vsnprintf(print_buffer, sizeof(print_buffer), fmt, va);
+    va_end(va);
+    fprintf(stderr, "%s\r\n", print_buffer);
+}
+
+static void print_warning(void *data, const char *message)
+{
+    (void)data;
+    lprintf("%s", message);
+}
+
+static void *safe_malloc(size_t size)
+{
+    void *block = malloc(size);
+    if(!block)
+        die("out of memory (size: %zu)", size);
+    return block;
+}
+
+static void *safe_realloc(void *block, size_t size)
+{
+    if(!(block = realloc(block, size)))
+        die("out of memory (size: %zu)", size);
+    return block;
+}
+
+/* 64-bit FNV-1a */
+static uint64_t hash64(uint64_t hash, const void *data, size_t n)
+{
+    const unsigned char *p = data;
+    while(n--) {
+        hash ^= *p++;
+        hash *= UINT64_C(1099511628211);
+    }
+    return hash;
+}
+
+static unsigned int default_num_threads(void)
+{
+#ifdef _SC_NPROCESSORS_ONLN
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    if(n > 0)
+        return (unsigned int)n;
+#endif
+    return 1;
+}
+
+static unsigned int parse_order(const char *s)
+{
+    if(!strcmp(s, "reverse"))
+        return DEFCON_ORDER_REVERSE;
+    if(!strcmp(s, "file"))
+        return DEFCON_ORDER_FILE;
+    if(!strcmp(s, "name"))
+        return DEFCON_ORDER_NAME;
+    die("unknown order: %s", s);
+    return DEFCON_ORDER_REVERSE;
+}
+
+static bool read_file(const char *filename, struct defcon_buffer *sb)
+{
+    FILE *fp = NULL;
+    char buffer[4096];
+    size_t n;
+    bool result;
+
+    defcon_buffer_clear(sb);
+    if(!(fp = fopen(filename, "rb")))
+        return false;
+    while((n = fread(buffer, 1, sizeof(buffer), fp)) != 0)
+        defcon_buffer_append(sb, buffer, n);
+    result = !ferror(fp);
+
+    fclose(fp);
+    return result;
+}
+
+static bool file_matches(const char *filename, const struct defcon_buffer *sb)
+{
+    FILE *fp = NULL;
+    char buffer[4096];
+    size_t n, offset = 0;
+    bool result = true;
+
+    if(!(fp = fopen(filename, "rb")))
+        return false;
+
+    while(result && (n = fread(buffer, 1, sizeof(buffer), fp)) != 0) {
+        if(n > sb->length - offset || memcmp(sb->data + offset, buffer, n))
+            result = false;
+        offset += n;
+    }
+
+    if(ferror(fp) || offset != sb->length)
+        result = false;
+
+    fclose(fp);
+    return result;
+}
+
+static bool write_all(int fd, const char *s, size_t n)
+{
+    ssize_t written;
+
+    while(n) {
+        if((written = write(fd, s, n)) < 0) {
+            if(errno == EINTR)
+                continue;
+            return false;
+        }
+
+        s += written;
+        n -= (size_t)written;
+    }
+
+    return true;
+}
+
+static void dirname_of(const char *filename, struct defcon_buffer *sb)
+{
+    const char *slash = strrchr(filename, '/');
+
+    defcon_buffer_clear(sb);
+    if(slash == filename)
+        defcon_buffer_putc(sb, '/');
+    else if(slash)
+        defcon_buffer_append(sb, filename, (size_t)(slash - filename));
+    else
+        defcon_buffer_putc(sb, '.');
+}
+
+/* Writes the contents to a fresh temporary file in the target's
+ * directory; nothing is visible under the real name until commit */
+static bool write_file(const char *filename, const struct defcon_buffer *sb)
+{
+    int fd;
+    const char *slash = strrchr(filename, '/');
+    struct staged_output *staged = NULL;
+    struct defcon_buffer temp_filename = { 0 }, target = { 0 };
+
+    if(slash)
+        defcon_buffer_append(&temp_filename, filename, (size_t)(slash - filename + 1));
+    defcon_buffer_printf(&temp_filename, ".%s.XXXXXX", slash ? (slash + 1) : filename);
+
+    if((fd = mkstemp(temp_filename.data)) < 0) {
+        lprintf("%s: warning: %s", filename, strerror(errno));
+        defcon_buffer_free(&temp_filename);
+        pthread_mutex_lock(&staging_lock);
+        staging_failed = true;
+        pthread_mutex_unlock(&staging_lock);
+        return false;
+    }
+
+    if(!write_all(fd, sb->data, sb->length) || (sync_outputs && fsync(fd) != 0) || fchmod(fd, output_mode) != 0 || close(fd) != 0) {
+        lprintf("%s: warning: %s", filename, strerror(errno));
+        unlink(temp_filename.data);
+        defcon_buffer_free(&temp_filename);
+        pthread_mutex_lock(&staging_lock);
+        staging_failed = true;
+        pthread_mutex_unlock(&staging_lock);
+        return false;
+    }
+
+    defcon_buffer_puts(&target, filename);
+
+    pthread_mutex_lock(&staging_lock);
+
+    if(num_staged_outputs >= staged_outputs_capacity) {
+        staged_outputs_capacity = staged_outputs_capacity ? (staged_outputs_capacity * 2) : 16;
+        staged_outputs = safe_realloc(staged_outputs, staged_outputs_capacity * sizeof(struct staged_output));
+    }
+
+    staged = &staged_outputs[num_staged_outputs++];
+    staged->filename = target;
+    staged->temp_filename = temp_filename;
+
+    pthread_mutex_unlock(&staging_lock);
+    return true;
+}
+
+static void sync_directory(const char *dirname)
+{
+    int fd;
+    if((fd = open(dirname, O_RDONLY)) < 0)
+        return;
+    fsync(fd);
+    close(fd);
+}
+
+/* Renames every staged output into place; if any of them
+ * failed to be written none of them are published */
+static bool commit_outputs(void)
+{
+    size_t i;
+    bool result = !staging_failed;
+    struct staged_output *staged = NULL;
+    struct defcon_buffer dirname = { 0 }, synced_dirname = { 0 };
+
+    if(staging_failed && num_staged_outputs)
+        lprintf("%s: warning: not all outputs could be written, leaving the old ones in place", argv_0);
+
+    for(i = 0; i < num_staged_outputs; i++) {
+        staged = &staged_outputs[i];
+
+        if(staging_failed) {
+            unlink(staged->temp_filename.data);
+        }
+        else if(rename(staged->temp_filename.data, staged->filename.data) != 0) {
+            lprintf("%s: warning: %s", staged->filename.data, strerror(errno));
+            unlink(staged->temp_filename.data);
+            result = false;
+        }
+        else if(sync_outputs) {
+            /* Make the rename itself durable; outputs usually
+             * share a directory so only sync each one once */
+            dirname_of(staged->filename.data, &dirname);
+            if(!synced_dirname.data || strcmp(dirname.data, synced_dirname.data)) {
+                sync_directory(dirname.data);
+                defcon_buffer_clear(&synced_dirname);
+                defcon_buffer_append(&synced_dirname, dirname.data, dirname.length);
+            }
+        }
+
+        defcon_buffer_free(&staged->filename);
+        defcon_buffer_free(&staged->temp_filename);
+    }
+
+    free(staged_outputs);
+    staged_outputs = NULL;
+    num_staged_outputs = 0;
+    staged_outputs_capacity = 0;
+    staging_failed = false;
+
+    defcon_buffer_free(&synced_dirname);
+    defcon_buffer_free(&dirname);
+
+    return result;
+}
+
+/* Don't leave temporary files behind when dying halfway */
+static void discard_outputs(void)
+{
+    size_t i;
+    for(i = 0; i < num_staged_outputs; i++)
+        unlink(staged_outputs[i].temp_filename.data);
+}
+
+static bool write_output(const char *filename, const struct defcon_buffer *sb)
+{
+    if(update_changed_only && file_matches(filename, sb)) {
+        lprintf("%s: unchanged", filename);
+        return true;
+    }
+
+    return write_file(filename, sb);
+}
+
+static bool generate_c_header(const struct defcon *ctx, const char *filename)
+{
+    bool result;
+    struct defcon_buffer out = { 0 };
+
+    defcon_format_c_header(ctx, &out);
+    result = write_output(filename, &out);
+    defcon_buffer_free(&out);
+    return result;
+}
+
+static bool generate_makefile(const struct defcon *ctx, const char *filename)
+{
+    bool result;
+    struct defcon_buffer out = { 0 };
+
+    defcon_format_makefile(ctx, &out);
+    result = write_output(filename, &out);
+    defcon_buffer_free(&out);
+    return result;
+}
+
+static bool generate_ninja(const struct defcon *ctx, const char *filename)
+{
+    bool result;
+    struct defcon_buffer out = { 0 };
+
+    defcon_format_ninja(ctx, &out);
+    result = write_output(filename, &out);
+    defcon_buffer_free(&out);
+    return result;
+}
+
+static bool generate_index(const struct defcon *ctx, const char *filename)
+{
+    bool result = false;
+    struct defcon_buffer out = { 0 };
+
+    if(defcon_format_index(ctx, &out))
+        result = write_output(filename, &out);
+    defcon_buffer_free(&out);
+    return result;
+}
+
+static bool dump_keys_to_stdout(const struct defcon *ctx)
+{
+    bool result;
+    struct defcon_buffer out = { 0 };
+
+    defcon_format_dump(ctx, &out);
+    result = write_all(STDOUT_FILENO, out.data, out.length);
+    defcon_buffer_free(&out);
+    return result;
+}
+
+/* -D values were checked for the '=' when the options were read */
+static int apply_overrides(struct defcon *ctx, const struct overrides *ov)
+{
+    int error = DEFCON_OK;
+    size_t i, length;
+    const char *key, *value;
+    struct defcon_buffer name = { 0 };
+
+    for(i = 0; ov->use_environment && environ[i]; i++) {
+        if(strncmp(environ[i], ENV_PREFIX, strlen(ENV_PREFIX)) || !(value = strchr(environ[i], '=')))
+            continue;
+
+        key = environ[i] + strlen(ENV_PREFIX);
+        length = (size_t)(value - key);
+        switch((error = defcon_set_key(ctx, key, length, value + 1))) {
+            case DEFCON_OK:
+                break;
+            case DEFCON_ERROR_UNDEFINED_KEY:
+                if(!ov->suppress_undefined)
+                    lprintf("environment: warning: undefined key: %.*s", (int)(value - environ[i]), environ[i]);
+                error = DEFCON_OK;
+                break;
+            default:
+                return error;
+        }
+    }
+
+    for(i = 0; i < ov->num_defines; i++) {
+        value = strchr(ov->defines[i], '=');
+        defcon_buffer_clear(&name);
+        defcon_buffer_append(&name, ov->defines[i], (size_t)(value - ov->defines[i]));
+        if((error = defcon_set(ctx, name.data, value + 1)) != DEFCON_OK)
+            break;
+    }
+
+    defcon_buffer_free(&name);
+    return error;
+}
+
+static void resolve_config(struct defcon *ctx, const char *filename, const struct overrides *ov)
+{
+    defcon_reset(ctx);
+    if(defcon_apply_conf(ctx, filename) != DEFCON_OK || apply_overrides(ctx, ov) != DEFCON_OK)
+        die("%s", defcon_error_message(ctx));
+    if(defcon_check(ctx) != DEFCON_OK)
+        die("%s!", defcon_error_message(ctx));
+    defcon_render(ctx);
+}
+
+/* Both input files are resolved against the same table one after
+ * the other. The keys stay put in between, so the values can be
+ * compared key by key in a single pass */
+static bool diff_configs(struct defcon *ctx, const char *filename_a, const char *filename_b, const struct overrides *ov, bool list_keys)
+{
+    bool result;
+    size_t i, length, num_keys;
+    size_t *offsets = NULL;
+    struct defcon_key key;
+    struct defcon_buffer values = { 0 }, out = { 0 };
+
+    resolve_config(ctx, filename_a, ov);
+    num_keys = defcon_num_keys(ctx);
+    offsets = safe_malloc((num_keys + 1) * sizeof(size_t));
+    for(i = 0; i < num_keys; i++) {
+        defcon_get_key(ctx, i, &key);
+        offsets[i] = values.length;
+        defcon_buffer_append(&values, key.value, key.value_length);
+    }
+    offsets[num_keys] = values.length;
+
+    resolve_config(ctx, filename_b, ov);
+    for(i = 0; i < num_keys; i++) {
+        defcon_get_key(ctx, i, &key);
+        length = offsets[i + 1] - offsets[i];
+        if(length == key.value_length && (!length || !memcmp(values.data + offsets[i], key.value, length)))
+            continue;
+
+        if(list_keys) {
+            defcon_buffer_printf(&out, "%s%s\n", defcon_prefix(ctx), key.key);
+            continue;
+        }
+
+        defcon_buffer_printf(&out, "-%s = ", key.name);
+        defcon_buffer_append(&out, values.data + offsets[i], length);
+        defcon_buffer_printf(&out, "\n+%s = ", key.name);
+        defcon_buffer_append(&out, key.value, key.value_length);
+        defcon_buffer_putc(&out, '\n');
+    }
+
+    result = write_all(STDOUT_FILENO, out.data, out.length);
+
+    free(offsets);
+    defcon_buffer_free(&values);
+    defcon_buffer_free(&out);
+    return result;
+}
+
+/* Writes one header per key into the directory and an aggregate
+ * header including all of them. Key headers are only rewritten when
+ * the value changes, so sources including just the keys they use
+ * are only rebuilt when one of those keys changes */
+static bool generate_key_headers(const struct defcon *ctx, const char *dirname)
+{
+    size_t i, num_updated = 0, num_keys = defcon_num_keys(ctx);
+    bool result = true;
+    struct defcon_key key;
+    struct defcon_buffer out = { 0 }, all = { 0 }, path = { 0 };
+
+    if(mkdir(dirname, 0777) != 0 && errno != EEXIST) {
+        lprintf("%s: warning: %s", dirname, strerror(errno));
+        return false;
+    }
+
+    defcon_buffer_puts(&all, "#ifndef __CONFIG_ALL_KEYS_H__\n");
+    defcon_buffer_puts(&all, "#define __CONFIG_ALL_KEYS_H__ 1\n");
+
+    for(i = 0; i < num_keys; i++) {
+        defcon_get_key(ctx, i, &key);
+
+        defcon_buffer_clear(&out);
+        defcon_format_define(ctx, i, &out);
+
+        defcon_buffer_clear(&path);
+        defcon_buffer_printf(&path, "%s/%s.h", dirname, key.key);
+        if(!file_matches(path.data, &out)) {
+            if(!write_file(path.data, &out))
+                result = false;
+            num_updated++;
+        }
+
+        defcon_buffer_printf(&all, "#include \"%s.h\"\n", key.key);
+    }
+
+    defcon_buffer_puts(&all, "#endif\n");
+
+    defcon_buffer_clear(&path);
+    defcon_buffer_printf(&path, "%s/%s", dirname, KEY_HEADERS_AGGREGATE);
+    if(!file_matches(path.data, &all) && !write_file(path.data, &all))
+        result = false;
+
+    if(update_changed_only)
+        lprintf("%s: %zu of %zu key headers updated", dirname, num_updated, num_keys);
+
+    defcon_buffer_free(&path);
+    defcon_buffer_free(&all);
+    defcon_buffer_free(&out);
+
+    return result;
+}
+
+static void depfile_path(struct defcon_buffer *sb, const char *path)
+{
+    for(; *path; path++) {
+        if(*path == ' ' || *path == '\\' || *path == '#')
+            defcon_buffer_putc(sb, '\\');
+        else if(*path == '$')
+            defcon_buffer_putc(sb, '$');
+        defcon_buffer_putc(sb, *path);
+    }
+}
+
+/* Writes <filename>.d listing every input that went into the output;
+ * the inputs also get empty rules so removing one doesn't break make */
+static bool generate_depfile(const char *filename, const char **inputs, size_t num_inputs)
+{
+    bool result;
+    size_t i;
+    struct defcon_buffer out = { 0 }, depfile = { 0 };
+
+    defcon_buffer_printf(&depfile, "%s.d", filename);
+
+    depfile_path(&out, filename);
+    defcon_buffer_putc(&out, ':');
+    for(i = 0; i < num_inputs; i++) {
+        defcon_buffer_printf(&out, " \\\n  ");
+        depfile_path(&out, inputs[i]);
+    }
+    defcon_buffer_putc(&out, '\n');
+
+    for(i = 0; i < num_inputs; i++) {
+        defcon_buffer_putc(&out, '\n');
+        depfile_path(&out, inputs[i]);
+        defcon_buffer_printf(&out, ":\n");
+    }
+
+    result = write_output(depfile.data, &out);
+
+    defcon_buffer_free(&depfile);
+    defcon_buffer_free(&out);
+
+    return result;
+}
+
+static bool is_ident(char c)
+{
+    return isalnum((unsigned char)c) || c == '_';
+}
+
+/* Every prefixed identifier is looked up among the config keys, so
+ * the scan is a single pass no matter how many keys there are */
+static void scan_config_keys(const struct defcon *ctx, const struct defcon_buffer *source, struct key_set *used)
+{
+    const char *prefix = defcon_prefix(ctx);
+    size_t i = 0, j, index, prefix_len = strlen(prefix);
+    const char *key;
+    size_t key_len;
+
+    while(i < source->length) {
+        if(!is_ident(source->data[i])) {
+            i++;
+            continue;
+        }
+
+        for(j = i; j < source->length && is_ident(source->data[j]); j++);
+
+        if(j - i > prefix_len && !memcmp(source->data + i, prefix, prefix_len)) {
+            key = source->data + i + prefix_len;
+            key_len = j - i - prefix_len;
+            if(defcon_find_key(ctx, key, key_len, &index) && !used->seen[index]) {
+                used->seen[index] = true;
+                used->keys[used->count++] = index;
+            }
+        }
+
+        i = j;
+    }
+}
+
+/* Splits the first rule of a depfile into the raw target text
+ * and a NUL-separated list of unescaped prerequisites */
+static bool parse_depfile(const struct defcon_buffer *in, struct defcon_buffer *target, struct defcon_buffer *prereqs)
+{
+    size_t i = 0, n = in->length;
+    const char *s = in->data;
+    bool in_token = false;
+
+    for(; i < n && s[i] != ':'; i++) {
+        if(s[i] == '\\' && i + 1 < n)
+            defcon_buffer_putc(target, s[i++]);
+        defcon_buffer_putc(target, s[i]);
+    }
+
+    if(i++ >= n)
+        return false;
+
+    while(i < n) {
+        if(s[i] == '\\' && i + 1 < n && (s[i + 1] == '\n' || s[i + 1] == '\r')) {
+            i += (s[i + 1] == '\r' && i + 2 < n && s[i + 2] == '\n') ? 3 : 2;
+        }
+        else if(s[i] == '\n') {
+            break;
+        }
+        else if(isspace((unsigned char)s[i])) {
+            i++;
+        }
+        else {
+            in_token = true;
+            if(s[i] == '\\' && i + 1 < n && (s[i + 1] == ' ' || s[i + 1] == '#' || s[i + 1] == '\\'))
+                i++;
+            else if(s[i] == '$' && i + 1 < n && s[i + 1] == '$')
+                i++;
+            defcon_buffer_putc(prereqs, s[i++]);
+            if(i < n && !isspace((unsigned char)s[i]))
+                continue;
+        }
+
+        if(in_token) {
+            defcon_buffer_putc(prereqs, 0);
+            in_token = false;
+        }
+    }
+
+    if(in_token)
+        defcon_buffer_putc(prereqs, 0);
+    return true;
+}
+
+static bool is_config_header(const char *path, const struct stat *headers, size_t num_headers, const struct stat *key_dir)
+{
+    size_t i;
+    struct stat st;
+    const char *slash = strrchr(path, '/');
+    struct defcon_buffer dirname = { 0 };
+    bool result = false;
+
+    if(stat(path, &st) != 0)
+        return false;
+
+    for(i = 0; i < num_headers; i++) {
+        if(st.st_dev == headers[i].st_dev && st.st_ino == headers[i].st_ino)
+            return true;
+    }
+
+    if(slash)
+        defcon_buffer_append(&dirname, path, (size_t)(slash - path));
+    else
+        defcon_buffer_putc(&dirname, '.');
+
+    if(stat(dirname.data, &st) == 0)
+        result = st.st_dev == key_dir->st_dev && st.st_ino == key_dir->st_ino;
+
+    defcon_buffer_free(&dirname);
+    return result;
+}
+
+static void key_set_init(const struct defcon *ctx, struct key_set *used)
+{
+    used->seen = safe_malloc(defcon_num_keys(ctx) + 1);
+    used->keys = safe_malloc((defcon_num_keys(ctx) + 1) * sizeof(size_t));
+    used->count = 0;
+    memset(used->seen, 0, defcon_num_keys(ctx) + 1);
+}
+
+static void key_set_free(struct key_set *used)
+{
+    free(used->seen);
+    free(used->keys);
+}
+
+static void key_header_path(const struct defcon *ctx, const char *key_dir, size_t index, struct defcon_buffer *path)
+{
+    struct defcon_key key;
+    defcon_get_key(ctx, index, &key);
+    defcon_buffer_clear(path);
+    defcon_buffer_printf(path, "%s/%s.h", key_dir, key.key);
+}
+
+/* Reads a compiler-generated depfile and finds the keys mentioned
+ * by its prerequisites; the ones that aren't config headers are
+ * kept as a NUL-separated list */
+static bool scan_depfile(const struct defcon *ctx, const char *filename, const char *key_dir, const struct stat *headers, size_t num_headers,
+    struct defcon_buffer *target, struct defcon_buffer *kept, struct key_set *used)
+{
+    bool result = false;
+    const char *prereq;
+    struct stat key_dir_st;
+    struct defcon_buffer in = { 0 }, prereqs = { 0 }, source = { 0 };
+    size_t i;
+
+    if(stat(key_dir, &key_dir_st) != 0) {
+        lprintf("%s: warning: %s", key_dir, strerror(errno));
+        return false;
+    }
+
+    if(!read_file(filename, &in)) {
+        lprintf("%s: warning: unable to read file", filename);
+        return false;
+    }
+
+    if(!parse_depfile(&in, target, &prereqs)) {
+        lprintf("%s: warning: parse error", filename);
+        goto out;
+    }
+
+    for(i = 0; i < prereqs.length; i += strlen(prereq) + 1) {
+        prereq = prereqs.data + i;
+        if(is_config_header(prereq, headers, num_headers, &key_dir_st))
+            continue;
+
+        defcon_buffer_append(kept, prereq, strlen(prereq) + 1);
+        if(read_file(prereq, &source))
+            scan_config_keys(ctx, &source, used);
+    }
+
+    result = true;
+
+out:
+    defcon_buffer_free(&source);
+    defcon_buffer_free(&prereqs);
+    defcon_buffer_free(&in);
+
+    return result;
+}
+
+/* Rewrites a compiler-generated depfile so that instead of the
+ * monolithic config headers the object depends on the key headers
+ * of the keys its prerequisites actually mention */
+static bool rewrite_depfile(const struct defcon *ctx, const char *filename, const char *key_dir, const struct stat *headers, size_t num_headers)
+{
+    bool result = false;
+    const char *prereq;
+    struct key_set used;
+    struct defcon_buffer target = { 0 }, kept = { 0 }, out = { 0 }, path = { 0 };
+    size_t i;
+
+    key_set_init(ctx, &used);
+
+    if(scan_depfile(ctx, filename, key_dir, headers, num_headers, &target, &kept, &used)) {
+        defcon_buffer_append(&out, target.data, target.length);
+        defcon_buffer_putc(&out, ':');
+
+        for(i = 0; i < kept.length; i += strlen(prereq) + 1) {
+            prereq = kept.data + i;
+            defcon_buffer_printf(&out, " \\\n  ");
+            depfile_path(&out, prereq);
+        }
+
+        for(i = 0; i < used.count; i++) {
+            key_header_path(ctx, key_dir, used.keys[i], &path);
+            defcon_buffer_printf(&out, " \\\n  ");
+            depfile_path(&out, path.data);
+        }
+
+        defcon_buffer_putc(&out, '\n');
+        result = write_output(filename, &out);
+    }
+
+    key_set_free(&used);
+    defcon_buffer_free(&path);
+    defcon_buffer_free(&out);
+    defcon_buffer_free(&kept);
+    defcon_buffer_free(&target);
+
+    return result;
+}
+
+/* Spaces, colons and dollar signs need escaping in ninja paths */
+static void ninja_path(struct defcon_buffer *sb, const char *path, size_t length)
+{
+    size_t i;
+    for(i = 0; i < length; i++) {
+        if(path[i] == ' ' || path[i] == ':' || path[i] == '$')
+            defcon_buffer_putc(sb, '$');
+        defcon_buffer_putc(sb, path[i]);
+    }
+}
+
+/* The target of a depfile rule is still escaped for make; a dyndep
+ * build statement takes exactly one output, so it's the first one */
+static void unescape_target(const struct defcon_buffer *target, struct defcon_buffer *out)
+{
+    size_t i = 0;
+    const char *s = target->data;
+
+    while(i < target->length && isspace((unsigned char)s[i]))
+        i++;
+
+    while(i < target->length && !isspace((unsigned char)s[i])) {
+        if(s[i] == '\\' && i + 1 < target->length && (s[i + 1] == ' ' || s[i + 1] == '#' || s[i + 1] == '\\'))
+            i++;
+        else if(s[i] == '$' && i + 1 < target->length && s[i + 1] == '$')
+            i++;
+        defcon_buffer_putc(out, s[i++]);
+    }
+}
+
+/* Adds a build statement to a ninja dyndep file making the target
+ * of a compiler-generated depfile depend on the key headers of the
+ * keys its prerequisites mention; the depfile is left alone */
+static bool add_dyndep_entry(const struct defcon *ctx, struct defcon_buffer *dyndep, const char *filename, const char *key_dir, const struct stat *headers, size_t num_headers)
+{
+    bool result = false;
+    struct key_set used;
+    struct defcon_buffer target = { 0 }, kept = { 0 }, output = { 0 }, path = { 0 };
+    size_t i;
+
+    key_set_init(ctx, &used);
+
+    if(scan_depfile(ctx, filename, key_dir, headers, num_headers, &target, &kept, &used)) {
+        unescape_target(&target, &output);
+        if(!output.length) {
+            lprintf("%s: warning: no target", filename);
+        }
+        else {
+            defcon_buffer_puts(dyndep, "build ");
+            ninja_path(dyndep, output.data, output.length);
+            defcon_buffer_puts(dyndep, ": dyndep");
+            for(i = 0; i < used.count; i++) {
+                key_header_path(ctx, key_dir, used.keys[i], &path);
+                defcon_buffer_puts(dyndep, i ? " " : " | ");
+                ninja_path(dyndep, path.data, path.length);
+            }
+            defcon_buffer_putc(dyndep, '\n');
+            result = true;
+        }
+    }
+
+    key_set_free(&used);
+    defcon_buffer_free(&path);
+    defcon_buffer_free(&output);
+    defcon_buffer_free(&kept);
+    defcon_buffer_free(&target);
+
+    return result;
+}
+
+static double elapsed_milliseconds(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)(now.tv_sec - start->tv_sec) * 1000.0 + (double)(now.tv_nsec - start->tv_nsec) / 1000000.0;
+}
+
+static void run_output_job(const struct output_queue *queue, struct output_job *job)
+{
+    struct timespec start;
+    struct defcon_buffer path = { 0 };
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    switch(job->type) {
+        case OUTPUT_C_HEADER:
+            job->result = generate_c_header(queue->ctx, job->filename);
+            defcon_buffer_puts(&path, job->filename);
+            break;
+        case OUTPUT_MAKEFILE:
+            job->result = generate_makefile(queue->ctx, job->filename);
+            defcon_buffer_puts(&path, job->filename);
+            break;
+        case OUTPUT_KEY_HEADERS:
+            job->result = generate_key_headers(queue->ctx, job->filename);
+            defcon_buffer_printf(&path, "%s/%s", job->filename, KEY_HEADERS_AGGREGATE);
+            break;
+        case OUTPUT_NINJA:
+            job->result = generate_ninja(queue->ctx, job->filename);
+            defcon_buffer_puts(&path, job->filename);
+            break;
+        case OUTPUT_INDEX:
+            job->result = generate_index(queue->ctx, job->filename);
+            defcon_buffer_puts(&path, job->filename);
+            break;
+    }
+
+    if(job->result && queue->write_depfiles)
+        job->result = generate_depfile(path.data, queue->inputs, queue->num_inputs);
+
+    job->milliseconds = elapsed_milliseconds(&start);
+    defcon_buffer_free(&path);
+}
+
+static void *output_thread(void *arg)
+{
+    struct output_queue *queue = arg;
+    struct output_job *job = NULL;
+
+    for(;;) {
+        pthread_mutex_lock(&queue->lock);
+        job = (queue->next_job < queue->num_jobs) ? &queue->jobs[queue->next_job++] : NULL;
+        pthread_mutex_unlock(&queue->lock);
+
+        if(!job)
+            break;
+        run_output_job(queue, job);
+    }
+
+    return NULL;
+}
+
+/* The calling thread works on the queue as well,
+ * so a single thread doesn't start any new ones */
+static void generate_outputs(struct output_queue *queue, unsigned int num_threads)
+{
+    size_t i;
+    unsigned int num_started = 0;
+    pthread_t *threads = NULL;
+
+    if(num_threads > queue->num_jobs)
+        num_threads = (unsigned int)queue->num_jobs;
+
+    queue->next_job = 0;
+    pthread_mutex_init(&queue->lock, NULL);
+
+    if(num_threads > 1) {
+        threads = safe_malloc((num_threads - 1) * sizeof(pthread_t));
+        while(num_started < num_threads - 1 && !pthread_create(&threads[num_started], NULL, &output_thread, queue))
+            num_started++;
+    }
+
+    output_thread(queue);
+
+    for(i = 0; i < num_started; i++)
+        pthread_join(threads[i], NULL);
+
+    pthread_mutex_destroy(&queue->lock);
+    free(threads);
+}
+
+static uint64_t hash64_file(uint64_t hash, const char *filename)
+{
+    struct stat st;
+    uintmax_t fields[7];
+
+    hash = hash64(hash, filename, strlen(filename) + 1);
+    if(stat(filename, &st) != 0)
+        return hash64(hash, "-", 1);
+
+    fields[0] = (uintmax_t)st.st_dev;
+    fields[1] = (uintmax_t)st.st_ino;
+    fields[2] = (uintmax_t)st.st_size;
+    fields[3] = (uintmax_t)st.st_mtim.tv_sec;
+    fields[4] = (uintmax_t)st.st_mtim.tv_nsec;
+    fields[5] = (uintmax_t)st.st_ctim.tv_sec;
+    fields[6] = (uintmax_t)st.st_ctim.tv_nsec;
+    return hash64(hash, fields, sizeof(fields));
+}
 
-#include "inih/ini.h"
+/* Covers the version, the whole command line and the metadata of every
+ * input. Only stat() is needed, and any write to an input changes at
+ * least its ctime, so nothing has to be read to tell a no-op run */
+static uint64_t run_fingerprint(int argc, char **argv, const struct defcon *ctx, const char *input_filename, const struct overrides *ov)
+{
+    int i;
+    size_t j, num_files;
+    const char *const *files = defcon_files(ctx, &num_files);
+    uint64_t hash = UINT64_C(14695981039346656037);
 
-#define DEFCON_VERSION "0.0.1"
+    hash = hash64(hash, DEFCON_VERSION, sizeof(DEFCON_VERSION));
+    for(i = 1; i < argc; i++)
+        hash = hash64(hash, argv[i], strlen(argv[i]) + 1);
+    for(j = 0; ov->use_environment && environ[j]; j++) {
+        if(!strncmp(environ[j], ENV_PREFIX, strlen(ENV_PREFIX)))
+            hash = hash64(hash, environ[j], strlen(environ[j]) + 1);
+    }
+    for(j = 0; j < num_files; j++)
+        hash = hash64_file(hash, files[j]);
+    return hash64_file(hash, input_filename);
+}
 
-#define VALUE_TYPE_STRING           0
-#define VALUE_TYPE_INTEGER          1
-#define VALUE_TYPE_HEX_INTEGER      2
-#define VALUE_TYPE_UNSIGNED_INTEGER 3
-#define VALUE_TYPE_BOOLEAN          4
+static void fingerprint_string(uint64_t fingerprint, struct defcon_buffer *sb)
+{
+    defcon_buffer_clear(sb);
+    defcon_buffer_printf(sb, "%016" PRIx64 "\n", fingerprint);
+}
 
-struct defcon_value {
-    unsigned int type;
-    union {
-        char string[128];
-        intmax_t integer;
-        uintmax_t unsigned_integer;
-        bool boolean;
-    } u;
-};
+static bool output_exists(const char *filename, bool write_depfiles)
+{
+    bool result;
+    struct defcon_buffer depfile = { 0 };
 
-struct defcon_def {
-    char name[64];
-    bool has_value;
-    bool value_required;
-    struct defcon_value value;
-    struct defcon_def *next;
-};
+    if(access(filename, F_OK) != 0)
+        return false;
+    if(!write_depfiles)
+        return true;
 
-static char print_buffer[4096] = { 0 };
-static const char *argv_0 = "defcon";
-static struct defcon_def *def_begin = NULL;
-static bool suppress_undefined_warnings = false;
-static char config_key_prefix[64] = "";
+    defcon_buffer_printf(&depfile, "%s.d", filename);
+    result = access(depfile.data, F_OK) == 0;
+    defcon_buffer_free(&depfile);
+    return result;
+}
 
-static void die(const char *fmt, ...)
+static bool outputs_exist(int argc, char **argv, const char *opt_string, bool write_depfiles)
 {
-    va_list va;
-    va_start(va, fmt);
-    vsnprintf(print_buffer, sizeof(print_buffer), fmt, va);
-    va_end(va);
-    fprintf(stderr, "%s: fatal: %s\n", argv_0, print_buffer);
-    exit(1);
+    int opt;
+    bool result = true;
+    struct defcon_buffer path = { 0 };
+
+    optind = 1;
+    while(result && (opt = getopt(argc, argv, opt_string)) != -1) {
+        switch(opt) {
+            case 'C':
+            case 'M':
+            case 'N':
+            case 'i':
+                result = output_exists(optarg, write_depfiles);
+                break;
+            case 'K':
+                defcon_buffer_clear(&path);
+                defcon_buffer_printf(&path, "%s/%s", optarg, KEY_HEADERS_AGGREGATE);
+                result = output_exists(path.data, write_depfiles);
+                break;
+        }
+    }
+
+    defcon_buffer_free(&path);
+    return result;
 }
 
-static void lprintf(const char *fmt, ...)
+static volatile sig_atomic_t session_stopped = 0;
+
+static void stop_session(int sig)
 {
-    va_list va;
-    va_start(va, fmt);
-    vsnprintf(print_buffer, sizeof(print_buffer), fmt, va);
-    va_end(va);
-    fputs(print_buffer, stderr);
-    fputs("\r\n", stderr);
+    (void)sig;
+    session_stopped = 1;
 }
 
-static void *safe_malloc(size_t size)
+static bool stat_changed(const struct stat *a, const struct stat *b)
 {
-    void *block = malloc(size);
-    if(!block)
-        die("out of memory (size: %zu)", size);
-    return block;
+    return a->st_dev != b->st_dev || a->st_ino != b->st_ino || a->st_size != b->st_size ||
+        a->st_mtim.tv_sec != b->st_mtim.tv_sec || a->st_mtim.tv_nsec != b->st_mtim.tv_nsec ||
+        a->st_ctim.tv_sec != b->st_ctim.tv_sec || a->st_ctim.tv_nsec != b->st_ctim.tv_nsec;
 }
 
-static bool parse_boolean(const char *s)
+/* A file that's missing now and was missing before didn't change */
+static bool file_changed(const char *filename, const struct stat *last)
 {
-    return atoi(s) || !strcmp(s, "true");
+    struct stat st;
+    if(stat(filename, &st) != 0)
+        memset(&st, 0, sizeof(st));
+    return stat_changed(&st, last);
 }
 
-static unsigned int parse_type(const char *s)
+static void report_missing_value(const struct defcon *ctx)
 {
-    if(!strcmp(s, "string"))
-        return VALUE_TYPE_STRING;
-    if(!strcmp(s, "integer"))
-        return VALUE_TYPE_INTEGER;
-    if(!strcmp(s, "hex_integer"))
-        return VALUE_TYPE_HEX_INTEGER;
-    if(!strcmp(s, "unsigned_integer"))
-        return VALUE_TYPE_UNSIGNED_INTEGER;
-    if(!strcmp(s, "boolean"))
-        return VALUE_TYPE_BOOLEAN;
-    return VALUE_TYPE_STRING;
+    lprintf("%s: warning: %s, outputs left alone", argv_0, defcon_error_message(ctx));
 }
 
-static void parse_value(const char *s, struct defcon_value *v, bool *success)
+/* Every definition file that loaded plus the input file; the
+ * names belong to the context, so this is redone on reload */
+static void collect_inputs(struct watch_state *w)
 {
-    bool result = false;
-    switch(v->type) {
-        case VALUE_TYPE_INTEGER:
-            result = sscanf(s, "%" SCNdMAX, &v->u.integer) == 1;
-            break;
-        case VALUE_TYPE_HEX_INTEGER:
-            result = sscanf(s, "0x%" SCNxMAX, &v->u.unsigned_integer) == 1;
-            break;
-        case VALUE_TYPE_UNSIGNED_INTEGER:
-            result = sscanf(s, "%" SCNuMAX, &v->u.unsigned_integer) == 1;
-            break;
-        case VALUE_TYPE_BOOLEAN:
-            v->u.boolean = parse_boolean(s);
-            result = true;
-            break;
-        default:
-            strncpy(v->u.string, s, sizeof(v->u.string));
-            result = v->type == VALUE_TYPE_STRING;
-            break;
-    }
+    size_t i, num_files;
+    const char *const *files = defcon_loaded_files(w->ctx, &num_files);
 
-    if(!success)
-        return;
-    *success = result;
+    free(w->inputs);
+    w->inputs = safe_malloc((num_files + 1) * sizeof(const char *));
+    for(i = 0; i < num_files; i++)
+        w->inputs[i] = files[i];
+    w->inputs[num_files] = w->input_filename;
+
+    w->outputs->inputs = w->inputs;
+    w->outputs->num_inputs = num_files + 1;
+}
+
+static void client_reply(struct client *client, const char *fmt, ...)
+{
+    va_list va;
+    char reply[4096];
+    int n;
+
+    va_start(va, fmt);
+    n = vsnprintf(reply, sizeof(reply) - 1, fmt, va);
+    va_end(va);
+
+    if(n < 0)
+        n = 0;
+    if((size_t)n > sizeof(reply) - 2)
+        n = (int)(sizeof(reply) - 2);
+    reply[n++] = '\n';
+    defcon_buffer_append(&client->out, reply, (size_t)n);
 }
 
-static struct defcon_def *get_def(const char *name)
+/* Client sockets don't block, whatever doesn't fit is sent once poll
+ * says there's room; false if the client is gone or doesn't read */
+static bool client_flush(struct client *client)
 {
-    struct defcon_def *def = NULL;
+    ssize_t n;
+    size_t sent = 0;
 
-    for(def = def_begin; def; def = def->next) {
-        if(strcmp(def->name, name))
+    while(sent < client->out.length) {
+        n = write(client->fd, client->out.data + sent, client->out.length - sent);
+        if(n < 0 && errno == EINTR)
             continue;
-        return def;
+        if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if(n < 0)
+            return false;
+        sent += (size_t)n;
+    }
+
+    if(sent) {
+        memmove(client->out.data, client->out.data + sent, client->out.length - sent);
+        client->out.length -= sent;
     }
 
-    def = safe_malloc(sizeof(struct defcon_def));
-    memset(def, 0, sizeof(struct defcon_def));
-    strncpy(def->name, name, sizeof(def->name));
-    def->value.type = VALUE_TYPE_STRING;
+    return client->out.length <= SERVER_MAX_OUTPUT;
+}
+
+/* Clients name files relative to where the server runs and can't
+ * get out of there, the socket may be shared with other users */
+static bool client_path_ok(struct client *client, const char *path)
+{
+    const char *s = path;
+    bool ok = *path && *path != '/';
+
+    while(ok && s) {
+        ok = !(s[0] == '.' && s[1] == '.' && (!s[2] || s[2] == '/'));
+        if((s = strchr(s, '/')))
+            s++;
+    }
 
-    def->next = def_begin;
-    def_begin = def;
+    if(!ok)
+        client_reply(client, "error %s: expected a relative path without ..", path);
+    return ok;
+}
 
-    return def;
+static const char *client_conf(const struct server *server, const struct client *client)
+{
+    return client->conf.length ? client->conf.data : server->session->input_filename;
 }
 
-static struct defcon_def *find_def(const char *name)
+/* The context holds one resolution at a time, so it's only redone
+ * when another client or a change of this one's settings needs it */
+static bool resolve_for(struct server *server, struct client *client)
 {
-    struct defcon_def *def = NULL;
+    size_t i;
+    const char *name, *value;
+    struct defcon *ctx = server->session->ctx;
 
-    for(def = def_begin; def; def = def->next) {
-        if(strcmp(def->name, name))
-            continue;
-        return def;
+    if(server->resolved_for == client && server->resolved_version == client->version)
+        return true;
+
+    server->resolved_for = NULL;
+    defcon_reset(ctx);
+
+    if(defcon_apply_conf(ctx, client_conf(server, client)) != DEFCON_OK ||
+        apply_overrides(ctx, server->session->overrides) != DEFCON_OK) {
+        client_reply(client, "error %s", defcon_error_message(ctx));
+        return false;
     }
 
-    return NULL;
+    for(i = 0; i < client->overrides.length; i += strlen(name) + strlen(value) + 2) {
+        name = client->overrides.data + i;
+        value = name + strlen(name) + 1;
+        if(defcon_set(ctx, name, value) != DEFCON_OK) {
+            client_reply(client, "error %s", defcon_error_message(ctx));
+            return false;
+        }
+    }
+
+    if(defcon_check(ctx) != DEFCON_OK) {
+        client_reply(client, "error %s", defcon_error_message(ctx));
+        return false;
+    }
+
+    defcon_render(ctx);
+    server->resolved_for = client;
+    server->resolved_version = client->version;
+    return true;
+}
+
+static void client_write_output(struct server *server, struct client *client, unsigned int type, const char *filename)
+{
+    struct output_job job;
+    struct output_queue queue;
+    const struct output_queue *outputs = server->session->outputs;
+    const char **inputs = NULL;
+
+    if(!client_path_ok(client, filename) || !resolve_for(server, client))
+        return;
+
+    /* Same inputs, but with this client's input file */
+    inputs = safe_malloc((outputs->num_inputs + 1) * sizeof(const char *));
+    memcpy(inputs, outputs->inputs, outputs->num_inputs * sizeof(const char *));
+    inputs[outputs->num_inputs - 1] = client_conf(server, client);
+
+    memset(&job, 0, sizeof(job));
+    job.type = type;
+    job.filename = filename;
+
+    memset(&queue, 0, sizeof(queue));
+    queue.ctx = server->session->ctx;
+    queue.jobs = &job;
+    queue.num_jobs = 1;
+    queue.inputs = inputs;
+    queue.num_inputs = outputs->num_inputs;
+    queue.write_depfiles = server->write_depfiles;
+
+    run_output_job(&queue, &job);
+    if(commit_outputs() && job.result)
+        client_reply(client, "ok");
+    else
+        client_reply(client, "error %s: could not be written", filename);
+
+    free(inputs);
 }
 
-static int ini_callback_def(void *data, const char *section, const char *name, const char *value)
+/* Requests are single lines of a command and its argument; every
+ * one gets a single line back that starts with "ok" or "error" */
+static bool client_request(struct server *server, struct client *client, char *line)
 {
-    struct defcon_def *def = get_def(section);
+    char *arg = NULL, *value = NULL;
+    bool changed;
+    struct defcon *ctx = server->session->ctx;
+    struct defcon_buffer sb = { 0 };
+
+    if((arg = strchr(line, ' ')))
+        *arg++ = 0;
+    else
+        arg = line + strlen(line);
 
-    if(!strcmp(name, "type")) {
-        def->value.type = parse_type(value);
-        return 1;
+    if(!strcmp(line, "get")) {
+        if(!resolve_for(server, client))
+            return true;
+        if(defcon_get(ctx, arg, &sb) != DEFCON_OK)
+            client_reply(client, "error %s", defcon_error_message(ctx));
+        else
+            client_reply(client, "ok %s", sb.data);
+        defcon_buffer_free(&sb);
+    }
+    else if(!strcmp(line, "set")) {
+        if(!(value = strchr(arg, '=')) || value == arg) {
+            client_reply(client, "error expected set <key>=<value>");
+            return true;
+        }
+        *value++ = 0;
+        defcon_buffer_append(&client->overrides, arg, strlen(arg) + 1);
+        defcon_buffer_append(&client->overrides, value, strlen(value) + 1);
+        client->version++;
+        client_reply(client, "ok");
     }
+    else if(!strcmp(line, "conf")) {
+        if(!client_path_ok(client, arg))
+            return true;
+        defcon_buffer_clear(&client->conf);
+        defcon_buffer_puts(&client->conf, arg);
+        client->version++;
+        client_reply(client, "ok");
+    }
+    else if(!strcmp(line, "reset")) {
+        defcon_buffer_clear(&client->conf);
+        defcon_buffer_clear(&client->overrides);
+        client->version++;
+        client_reply(client, "ok");
+    }
+    else if(!strcmp(line, "resolve")) {
+        if(resolve_for(server, client))
+            client_reply(client, "ok %zu", defcon_num_keys(ctx));
+    }
+    else if(!strcmp(line, "header")) {
+        client_write_output(server, client, OUTPUT_C_HEADER, arg);
+    }
+    else if(!strcmp(line, "makefile")) {
+        client_write_output(server, client, OUTPUT_MAKEFILE, arg);
+    }
+    else if(!strcmp(line, "ninja")) {
+        client_write_output(server, client, OUTPUT_NINJA, arg);
+    }
+    else if(!strcmp(line, "index")) {
+        client_write_output(server, client, OUTPUT_INDEX, arg);
+    }
+    else if(!strcmp(line, "keys")) {
+        client_write_output(server, client, OUTPUT_KEY_HEADERS, arg);
+    }
+    else if(!strcmp(line, "reload")) {
+        if(defcon_reload(ctx, &changed) != DEFCON_OK) {
+            client_reply(client, "error %s", defcon_error_message(ctx));
+            return true;
+        }
 
-    if(!strcmp(name, "value")) {
-        parse_value(value, &def->value, &def->has_value);
-        return 1;
+        /* The defaults change, whatever was resolved is gone */
+        collect_inputs(server->session);
+        if(changed)
+            server->resolved_for = NULL;
+        client_reply(client, "ok %zu", defcon_num_keys(ctx));
+    }
+    else if(!strcmp(line, "quit")) {
+        return false;
+    }
+    else {
+        client_reply(client, "error unknown request: %s", line);
     }
 
-    if(!strcmp(name, "required")) {
-        def->value_required = parse_boolean(value);
-        return 1;
+    return true;
+}
+
+/* Handles every complete line that arrived; returns
+ * false once the client is done or misbehaved */
+static bool client_input(struct server *server, struct client *client)
+{
+    char buffer[4096], *line, *end;
+    size_t used = 0;
+    ssize_t n;
+
+    if((n = read(client->fd, buffer, sizeof(buffer))) <= 0)
+        return n < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK);
+    defcon_buffer_append(&client->in, buffer, (size_t)n);
+
+    for(line = client->in.data; (end = memchr(line, '\n', client->in.length - used)); line = end + 1) {
+        *end = 0;
+        if(end > line && end[-1] == '\r')
+            end[-1] = 0;
+        used += (size_t)(end - line) + 1;
+        if(*line && !client_request(server, client, line))
+            return false;
     }
 
-    lprintf("%s: %s: warning: unknown key: %s", data, section, name);
-    return 0;
+    if(client->in.length - used > SERVER_MAX_LINE)
+        return false;
+
+    memmove(client->in.data, client->in.data + used, client->in.length - used);
+    client->in.length -= used;
+    client->in.data[client->in.length] = 0;
+    return true;
 }
 
-static int init_callback_conf(void *data, const char *section, const char *name, const char *value)
+static void drop_client(struct server *server, size_t index)
 {
-    struct defcon_def *def = NULL;
+    struct client *client = &server->clients[index];
+
+    if(server->resolved_for == client)
+        server->resolved_for = NULL;
+
+    /* The replies up to a quit are still owed */
+    client_flush(client);
+    close(client->fd);
+    defcon_buffer_free(&client->in);
+    defcon_buffer_free(&client->out);
+    defcon_buffer_free(&client->conf);
+    defcon_buffer_free(&client->overrides);
 
-    if(!(def = find_def(name))) {
-        if(!suppress_undefined_warnings)
-            lprintf("%s: warning: undefined key: %s", data, name);
-        return 0;
+    /* Whatever was resolved for the client moved along
+     * with it is still valid, so keep track of it */
+    if(index != server->num_clients - 1) {
+        *client = server->clients[server->num_clients - 1];
+        if(server->resolved_for == &server->clients[server->num_clients - 1])
+            server->resolved_for = client;
     }
 
-    parse_value(value, &def->value, &def->has_value);
-    if(!def->has_value) {
-        lprintf("%s: %s: warning: unable to parse: %s", data, name, value);
-        return 0;
+    server->num_clients--;
+}
+
+static void add_client(struct server *server, int fd)
+{
+    struct client *client = NULL;
+
+    if(server->num_clients >= server->capacity) {
+        server->capacity = server->capacity ? (server->capacity * 2) : 16;
+        server->clients = safe_realloc(server->clients, server->capacity * sizeof(struct client));
+        /* resolved_for may point into the old array */
+        server->resolved_for = NULL;
     }
 
-    return 1;
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    client = &server->clients[server->num_clients++];
+    memset(client, 0, sizeof(struct client));
+    client->fd = fd;
 }
 
-static void make_config_key(const char *name, char *s, size_t n)
+/* Serves requests on a Unix socket with the definitions kept in
+ * memory until interrupted. Requests are handled one at a time in
+ * the order they arrive, any number of clients can be connected */
+static void serve(struct watch_state *w, const char *path, bool write_depfiles)
 {
+    int fd, client_fd;
     size_t i;
-    for(i = 0; i < n && *name; i++, name++) {
-        if(isalpha(*name)) {
-            s[i] = toupper(*name);
-            continue;
+    mode_t mask;
+    bool ok;
+    struct stat st;
+    struct client *client = NULL;
+    struct sockaddr_un addr;
+    struct sigaction sa;
+    struct pollfd *fds = NULL;
+    struct server server;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(strlen(path) >= sizeof(addr.sun_path))
+        die("%s: socket path too long", path);
+    strcpy(addr.sun_path, path);
+
+    /* A socket left behind by an earlier run is replaced, anything else stays */
+    if(lstat(path, &st) == 0 && !S_ISSOCK(st.st_mode))
+        die("%s: exists and is not a socket", path);
+
+    if((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+        die("%s: %s", path, strerror(errno));
+    unlink(path);
+
+    /* Only the owner gets to connect */
+    mask = umask(077);
+    ok = bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+    umask(mask);
+    if(!ok || listen(fd, SOMAXCONN) != 0)
+        die("%s: %s", path, strerror(errno));
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = &stop_session;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sa.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &sa, NULL);
+
+    memset(&server, 0, sizeof(server));
+    server.session = w;
+    server.write_depfiles = write_depfiles;
+
+    while(!session_stopped) {
+        fds = safe_realloc(fds, (server.num_clients + 1) * sizeof(struct pollfd));
+        fds[0].fd = fd;
+        fds[0].events = POLLIN;
+        /* A client's next requests wait until it took the replies */
+        for(i = 0; i < server.num_clients; i++) {
+            fds[i + 1].fd = server.clients[i].fd;
+            fds[i + 1].events = server.clients[i].out.length ? POLLOUT : POLLIN;
         }
 
-        if(isdigit(*name)) {
-            s[i] = *name;
+        if(poll(fds, server.num_clients + 1, -1) < 0)
             continue;
+
+        /* Backwards, dropping a client moves the last one */
+        for(i = server.num_clients; i > 0; i--) {
+            client = &server.clients[i - 1];
+            ok = true;
+            if(fds[i].revents & ~POLLOUT)
+                ok = client_input(&server, client);
+            if(!ok || !client_flush(client))
+                drop_client(&server, i - 1);
         }
 
-        s[i] = '_';
+        if((fds[0].revents & POLLIN) && (client_fd = accept(fd, NULL, NULL)) >= 0)
+            add_client(&server, client_fd);
     }
 
-    s[(i < n) ? i : (n - 1)] = 0;
+    while(server.num_clients)
+        drop_client(&server, server.num_clients - 1);
+
+    close(fd);
+    unlink(path);
+    free(fds);
+    free(server.clients);
 }
 
-static void value_string(const struct defcon_value *src, char *s, size_t n)
+#ifdef __linux__
+/* Editors tend to replace files rather than write them, so
+ * it's the directories holding the inputs that are watched */
+static void watch_directory(int fd, const char *dirname)
 {
-    switch(src->type) {
-        case VALUE_TYPE_STRING:
-            snprintf(s, n, "\"%s\"", src->u.string);
-            break;
-        case VALUE_TYPE_INTEGER:
-            snprintf(s, n, "%" PRIdMAX, src->u.integer);
-            break;
-        case VALUE_TYPE_HEX_INTEGER:
-            snprintf(s, n, "0x%" PRIXMAX, src->u.unsigned_integer);
-            break;
-        case VALUE_TYPE_UNSIGNED_INTEGER:
-            snprintf(s, n, "%" PRIuMAX, src->u.unsigned_integer);
-            break;
-        case VALUE_TYPE_BOOLEAN:
-            snprintf(s, n, "%d", src->u.boolean ? 1 : 0);
-            break;
-        default:
-            strncpy(s, src->u.string, n);
-            break;
+    uint32_t mask = IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE | IN_DELETE | IN_ATTRIB;
+    if(inotify_add_watch(fd, dirname, mask) < 0 && errno != ENOENT)
+        lprintf("%s: warning: %s", dirname, strerror(errno));
+}
+
+static void watch_inputs(struct watch_state *w)
+{
+    size_t i, num_dirs, num_files;
+    const char *const *dirs = defcon_dirs(w->ctx, &num_dirs);
+    const char *const *files = defcon_files(w->ctx, &num_files);
+    struct defcon_buffer dirname = { 0 };
+
+    for(i = 0; i < num_dirs; i++)
+        watch_directory(w->fd, dirs[i]);
+    for(i = 0; i < num_files; i++) {
+        dirname_of(files[i], &dirname);
+        watch_directory(w->fd, dirname.data);
     }
+
+    dirname_of(w->input_filename, &dirname);
+    watch_directory(w->fd, dirname.data);
+    defcon_buffer_free(&dirname);
 }
 
-static bool generate_c_header(const char *filename)
+/* Blocks until something happens and then until it's been quiet for
+ * a while. The events themselves don't matter, every input is checked
+ * afterwards, so it's fine if some of them are for unrelated files */
+static bool wait_for_changes(int fd)
 {
-    FILE *fp = NULL;
-    struct defcon_def *def = NULL;
-    char config_key[64], value[128] = { 0 };
+    union {
+        struct inotify_event event;
+        char data[4096];
+    } buffer;
+    struct pollfd pfd;
 
-    if(!(fp = fopen(filename, "w"))) {
-        lprintf("%s: warning: unable to open file", filename);
+    if(read(fd, &buffer, sizeof(buffer)) < 0)
         return false;
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    while(!session_stopped && poll(&pfd, 1, WATCH_DEBOUNCE_MS) > 0) {
+        if(read(fd, &buffer, sizeof(buffer)) < 0)
+            break;
     }
 
-    fprintf(fp, "#ifndef __CONFIG_H__\n");
-    fprintf(fp, "#define __CONFIG_H__ 1\n");
+    return !session_stopped;
+}
+
+/* Keeps the table in memory and brings the outputs up to date
+ * whenever the inputs change, until interrupted. Definition files
+ * are only parsed again when they changed; if only the input file
+ * did, it's applied on top of the defaults from the last merge and
+ * the outputs are only written if any of the values changed */
+static void watch_definitions(struct watch_state *w)
+{
+    bool defs_changed, input_changed;
+    struct sigaction sa;
 
-    for(def = def_begin; def; def = def->next) {
-        make_config_key(def->name, config_key, sizeof(config_key));
-        value_string(&def->value, value, sizeof(value));
-        fprintf(fp, "#define %s%s %s\n", config_key_prefix, config_key, value);
+    if((w->fd = inotify_init1(IN_CLOEXEC)) < 0) {
+        lprintf("%s: warning: can't watch for changes: %s", argv_0, strerror(errno));
+        return;
     }
 
-    fprintf(fp, "#endif\n");
+    /* No SA_RESTART, so a signal gets the loop out of read() */
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = &stop_session;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
 
-    fclose(fp);
-    return true;
+    watch_inputs(w);
+
+    while(!session_stopped) {
+        if(!wait_for_changes(w->fd))
+            continue;
+
+        if(defcon_reload(w->ctx, &defs_changed) != DEFCON_OK) {
+            lprintf("%s: warning: %s", argv_0, defcon_error_message(w->ctx));
+            continue;
+        }
+
+        collect_inputs(w);
+        watch_inputs(w);
+        input_changed = file_changed(w->input_filename, &w->input_st);
+        if(input_changed)
+            stat(w->input_filename, &w->input_st);
+        if(!defs_changed && !input_changed)
+            continue;
+
+        defcon_reset(w->ctx);
+        if(defcon_apply_conf(w->ctx, w->input_filename) != DEFCON_OK || apply_overrides(w->ctx, w->overrides) != DEFCON_OK) {
+            lprintf("%s: warning: %s", argv_0, defcon_error_message(w->ctx));
+            continue;
+        }
+
+        if(defcon_check(w->ctx) != DEFCON_OK) {
+            report_missing_value(w->ctx);
+            continue;
+        }
+
+        if(!defcon_render(w->ctx) && !defs_changed)
+            continue;
+
+        generate_outputs(w->outputs, w->num_threads);
+        commit_outputs();
+    }
+
+    close(w->fd);
 }
+#endif
 
-static bool generate_makefile(const char *filename)
+/* Every query gets a line, an empty one if the name isn't in the
+ * index, so the answers to a batch line up with the questions */
+static bool answer_query(const struct defcon_index *index, const char *name, size_t length, struct defcon_buffer *out)
 {
-    FILE *fp = NULL;
-    struct defcon_def *def = NULL;
-    char config_key[64], value[128] = { 0 };
+    const char *value;
+    size_t value_length;
 
-    if(!(fp = fopen(filename, "w"))) {
-        lprintf("%s: warning: unable to open file", filename);
+    if(!defcon_index_get(index, name, length, &value, &value_length)) {
+        lprintf("%s: warning: undefined key: %.*s", argv_0, (int)length, name);
+        defcon_buffer_putc(out, '\n');
         return false;
     }
 
-    for(def = def_begin; def; def = def->next) {
-        make_config_key(def->name, config_key, sizeof(config_key));
-        value_string(&def->value, value, sizeof(value));
-        fprintf(fp, "%s%s := %s\n", config_key_prefix, config_key, value);
+    defcon_buffer_append(out, value, value_length);
+    defcon_buffer_putc(out, '\n');
+    return true;
+}
+
+/* Without names on the command line they're read from stdin. The
+ * answers go out once per read, so a script feeding names through
+ * a pipe gets them as soon as it's sent a line */
+static bool run_queries(const char *index_filename, char **names, size_t num_names)
+{
+    bool result = true;
+    char chunk[65536];
+    char *eol;
+    ssize_t n;
+    size_t i, start, length;
+    struct defcon_index *index = NULL;
+    struct defcon_buffer in = { 0 }, out = { 0 };
+
+    if(!(index = defcon_index_open(index_filename)))
+        die("%s: %s", index_filename, (errno == EINVAL) ? "invalid or outdated index" : strerror(errno));
+
+    for(i = 0; i < num_names; i++)
+        result = answer_query(index, names[i], strlen(names[i]), &out) && result;
+
+    while(!num_names) {
+        if((n = read(STDIN_FILENO, chunk, sizeof(chunk))) < 0 && errno == EINTR)
+            continue;
+
+        if(n > 0) {
+            defcon_buffer_append(&in, chunk, (size_t)n);
+        }
+        else if(in.length) {
+            /* The last line may not have a newline */
+            defcon_buffer_putc(&in, '\n');
+        }
+
+        for(start = 0; start < in.length && (eol = memchr(in.data + start, '\n', in.length - start)); start += length + 1) {
+            length = (size_t)(eol - (in.data + start));
+            result = answer_query(index, in.data + start, (length && eol[-1] == '\r') ? (length - 1) : length, &out) && result;
+        }
+
+        if(start) {
+            memmove(in.data, in.data + start, in.length - start);
+            in.length -= start;
+        }
+
+        if(!write_all(STDOUT_FILENO, out.data, out.length) || n <= 0)
+            break;
+        defcon_buffer_clear(&out);
     }
 
-    fclose(fp);
-    return true;
+    if(num_names)
+        write_all(STDOUT_FILENO, out.data, out.length);
+
+    defcon_index_close(index);
+    defcon_buffer_free(&in);
+    defcon_buffer_free(&out);
+    return result;
 }
 
 static void usage(void)
 {
-    lprintf("Usage: %s [options] <definition files>...", argv_0);
+    lprintf("Usage: %s [options] <definitions>...", argv_0);
+    lprintf("       %s -i <index> -q [names]...", argv_0);
     lprintf("Options:");
     lprintf("   -C <filename>   : generate a C header");
     lprintf("   -M <filename>   : generate a makefile");
+    lprintf("   -N <filename>   : generate a ninja file defining the keys as variables");
+    lprintf("   -i <filename>   : generate an index of the values for -q");
+    lprintf("   -K <directory>  : generate a header per key and an aggregate " KEY_HEADERS_AGGREGATE);
     lprintf("   -c <filename>   : set the input file (default: defcon.conf)");
+    lprintf("   -D <name=value> : set a value on top of the input file (can be given more than once)");
+    lprintf("   -e              : set values from " ENV_PREFIX "<KEY> environment variables as well,");
+    lprintf("                     after the input file and before -D");
     lprintf("   -p <prefix>     : set the prefix for generated key-value pairs");
+    lprintf("   -o <order>      : emit keys in \"name\", \"file\" or \"reverse\" (default) file order");
+    lprintf("   -j <threads>    : parse inputs and write outputs on this many threads (default: CPU count)");
     lprintf("   -d              : dump all the keys to stdout in a parsable format");
+    lprintf("   -x <filename>   : resolve this input file as well and print the values that");
+    lprintf("                     differ from the ones the -c input file gives, and exit");
+    lprintf("   -X              : with -x, only list the changed keys, one per line");
+    lprintf("   -q              : print the values of the names given, or of the names read");
+    lprintf("                     from stdin one per line, from the -i index and exit");
     lprintf("   -s              : suppress \"undefined key\" warnings during parsing");
+    lprintf("   -F <depfile>    : make a compiler depfile depend on -K key headers instead of");
+    lprintf("                     the -C headers, and exit (can be given more than once)");
+    lprintf("   -y <filename>   : with -F, leave the depfiles alone and write what they would");
+    lprintf("                     depend on to a ninja dyndep file instead");
+    lprintf("   -b <filename>   : keep the parsed definition files in a snapshot and only parse");
+    lprintf("                     the ones that changed since it was saved");
+    lprintf("   -R              : read the files one at a time instead of ahead with io_uring");
+    lprintf("   -t <filename>   : record a fingerprint of the inputs and options in the file and");
+    lprintf("                     exit right away if it still matches and the outputs exist");
+    lprintf("   -m              : write a depfile (<filename>.d) for each generated file");
+    lprintf("   -f              : fsync outputs and their directories before publishing them");
+    lprintf("   -u              : leave outputs whose contents would not change untouched");
+    lprintf("   -l <socket>     : keep running and answer requests on a Unix socket only the");
+    lprintf("                     owner can connect to; files are named relative to the current");
+    lprintf("                     directory");
+    lprintf("   -w              : keep running and update the outputs whenever the inputs change");
+    lprintf("   -S              : print symbol table statistics and output timings on exit");
     lprintf("   -h              : print this message and exit");
     lprintf("   -v              : print version and exit");
-    lprintf("   <definitions>   : set the definition files");
+    lprintf("   <definitions>   : set the definition files; directories are searched for");
+    lprintf("                     *" DEFCON_FILE_SUFFIX " files and quoted patterns are expanded in name order");
 }
 
 static void version(void)
@@ -340,29 +1847,137 @@ static void version(void)
 
 int main(int argc, char **argv)
 {
-    int opt, i;
-    const char *opt_string = "C:M:c:p:dshv";
-    char input_filename[64] = "defcon.conf", value[128] = { 0 };
+    int opt;
+    size_t i;
+    bool outputs_ok;
+    uint64_t fingerprint = 0;
+    const char *stamp_filename = NULL;
+    const char *snapshot_filename = NULL;
+    const char *opt_string = "C:M:N:K:F:y:i:c:x:D:p:o:j:b:t:l:defmqsuwRXShv";
+    const char *input_filename = "defcon.conf";
+    struct output_queue outputs;
+    struct defcon_buffer stamp = { 0 };
+    struct defcon_buffer snapshot = { 0 };
+    struct defcon_stats stats;
+    struct defcon *ctx = NULL;
+    bool watch_mode = false;
+    const char *socket_path = NULL;
+    struct watch_state watch;
+    bool missing = false;
     bool dump_keys = false;
-    FILE *fp;
-    struct defcon_def *def = NULL, *next_def = NULL;
+    bool print_statistics = false;
+    bool write_depfiles = false;
+    const char *key_dir = NULL;
+    const char *dyndep_filename = NULL;
+    const char *diff_filename = NULL;
+    const char *index_filename = NULL;
+    bool query_mode = false;
+    bool use_reader = true;
+    struct overrides overrides;
+    bool diff_keys_only = false;
+    struct defcon_buffer dyndep = { 0 };
+    bool fixdep = false;
+    unsigned int order = DEFCON_ORDER_REVERSE;
+    unsigned int num_threads = default_num_threads();
+    struct stat *headers = NULL;
+    size_t num_headers = 0;
 
     argv_0 = argv[0];
+    memset(&outputs, 0, sizeof(outputs));
+    memset(&watch, 0, sizeof(watch));
+    memset(&overrides, 0, sizeof(overrides));
+    overrides.defines = safe_malloc((size_t)argc * sizeof(char *));
+
+    output_mode = umask(0);
+    umask(output_mode);
+    output_mode = 0666 & ~output_mode;
+    atexit(&discard_outputs);
+
+    ctx = defcon_create();
+    defcon_set_warning_handler(ctx, &print_warning, NULL);
 
     optind = 1;
     while((opt = getopt(argc, argv, opt_string)) != -1) {
         switch(opt) {
             case 'c':
-                strncpy(input_filename, optarg, sizeof(input_filename));
+                input_filename = optarg;
                 break;
             case 'p':
-                strncpy(config_key_prefix, optarg, sizeof(config_key_prefix));
+                defcon_set_prefix(ctx, optarg);
+                break;
+            case 'o':
+                order = parse_order(optarg);
+                break;
+            case 'j':
+                if(atoi(optarg) < 1)
+                    die("invalid number of threads: %s", optarg);
+                num_threads = (unsigned int)atoi(optarg);
                 break;
             case 'd':
                 dump_keys = true;
                 break;
+            case 'K':
+                key_dir = optarg;
+                break;
+            case 'b':
+                snapshot_filename = optarg;
+                break;
+            case 't':
+                stamp_filename = optarg;
+                break;
+            case 'F':
+                fixdep = true;
+                break;
+            case 'y':
+                dyndep_filename = optarg;
+                break;
+            case 'x':
+                diff_filename = optarg;
+                break;
+            case 'i':
+                index_filename = optarg;
+                break;
+            case 'q':
+                query_mode = true;
+                break;
+            case 'X':
+                diff_keys_only = true;
+                break;
             case 's':
-                suppress_undefined_warnings = true;
+                defcon_set_suppress_undefined(ctx, true);
+                overrides.suppress_undefined = true;
+                break;
+            case 'D':
+                if(!strchr(optarg, '=') || *optarg == '=')
+                    die("-D %s: expected <name>=<value>", optarg);
+                overrides.defines[overrides.num_defines++] = optarg;
+                break;
+            case 'e':
+                overrides.use_environment = true;
+                break;
+            case 'm':
+                write_depfiles = true;
+                break;
+            case 'f':
+                sync_outputs = true;
+                break;
+            case 'u':
+                update_changed_only = true;
+                break;
+            case 'l':
+                socket_path = optarg;
+                break;
+            case 'w':
+#ifndef __linux__
+                die("-w needs inotify, which is only available on Linux");
+#endif
+                watch_mode = true;
+                break;
+            case 'R':
+                use_reader = false;
+                break;
+            case 'S':
+                print_statistics = true;
                 break;
             case 'h':
                 usage();
@@ -376,66 +1991,201 @@ int main(int argc, char **argv)
         }
     }
 
+    /* Queries don't need the definitions, only the index */
+    if(query_mode) {
+        if(!index_filename)
+            die("-q requires -i");
+        if(dump_keys || fixdep || watch_mode || socket_path || diff_filename)
+            die("-q can't be combined with -d, -F, -w, -l or -x");
+        opt = run_queries(index_filename, argv + optind, (size_t)(argc - optind)) ? 0 : 1;
+        free(overrides.defines);
+        defcon_destroy(ctx);
+        return opt;
+    }
+
     if(optind >= argc)
         die("no definition files");
+    if(watch_mode && (dump_keys || fixdep))
+        die("-w can't be combined with -d or -F");
+    if(socket_path && (dump_keys || fixdep || watch_mode))
+        die("-l can't be combined with -d, -F or -w");
+    if(dyndep_filename && !fixdep)
+        die("-y requires -F");
+    if(diff_filename && (dump_keys || fixdep || watch_mode || socket_path))
+        die("-x can't be combined with -d, -F, -w or -l");
+    if(diff_keys_only && !diff_filename)
+        die("-X requires -x");
 
-    for(i = optind; i < argc; i++) {
-        if(!(fp = fopen(argv[i], "r"))) {
-            lprintf("%s: warning: %s", argv[i], strerror(errno));
-            continue;
+    defcon_set_threads(ctx, num_threads);
+    defcon_set_file_reader(ctx, use_reader);
+    if(snapshot_filename)
+        defcon_set_snapshot(ctx, snapshot_filename);
+    if(defcon_set_inputs(ctx, argv + optind, (size_t)(argc - optind)) != DEFCON_OK)
+        die("%s", defcon_error_message(ctx));
+
+    if(stamp_filename && !dump_keys && !fixdep && !watch_mode && !socket_path) {
+        fingerprint = run_fingerprint(argc, argv, ctx, input_filename, &overrides);
+        fingerprint_string(fingerprint, &stamp);
+        if(file_matches(stamp_filename, &stamp) && outputs_exist(argc, argv, opt_string, write_depfiles)) {
+            if(update_changed_only)
+                lprintf("%s: up to date", stamp_filename);
+            defcon_buffer_free(&stamp);
+            free(overrides.defines);
+            defcon_destroy(ctx);
+            return 0;
         }
+    }
 
-        if(ini_parse_file(fp, &ini_callback_def, argv[i]) < 0) {
-            lprintf("%s: warning: parse error", argv[i]);
-            continue;
+    if(defcon_load(ctx, (dump_keys || fixdep) ? NULL : input_filename, (watch_mode || socket_path) ? DEFCON_KEEP_FILES : 0) != DEFCON_OK)
+        die("%s", defcon_error_message(ctx));
+    if(snapshot_filename && defcon_take_snapshot(ctx, &snapshot))
+        write_file(snapshot_filename, &snapshot);
+    defcon_buffer_free(&snapshot);
+
+    defcon_sort(ctx, order);
+
+    if(fixdep) {
+        if(!key_dir)
+            die("-F requires -K");
+
+        defcon_render(ctx);
+        headers = safe_malloc((size_t)argc * sizeof(struct stat));
+
+        optind = 1;
+        while((opt = getopt(argc, argv, opt_string)) != -1) {
+            if(opt == 'C' && stat(optarg, &headers[num_headers]) == 0)
+                num_headers++;
         }
 
-        fclose(fp);
+        if(dyndep_filename)
+            defcon_buffer_puts(&dyndep, "ninja_dyndep_version = 1\n");
+
+        optind = 1;
+        while((opt = getopt(argc, argv, opt_string)) != -1) {
+            if(opt == 'F' && dyndep_filename)
+                add_dyndep_entry(ctx, &dyndep, optarg, key_dir, headers, num_headers);
+            else if(opt == 'F')
+                rewrite_depfile(ctx, optarg, key_dir, headers, num_headers);
+        }
+
+        if(dyndep_filename)
+            write_output(dyndep_filename, &dyndep);
+        goto safe_exit;
     }
 
     if(dump_keys) {
-        fprintf(stdout, "# This config will be parsed by defcon\n");
-        fprintf(stdout, "# without any serious problems but I'd\n");
-        fprintf(stdout, "# recommend editing it to make it readable\n");
+        defcon_render(ctx);
+        dump_keys_to_stdout(ctx);
+        goto safe_exit;
+    }
 
-        for(def = def_begin; def; def = def->next) {
-            value_string(&def->value, value, sizeof(value));
-            fprintf(stdout, "%s = %s\n", def->name, value);
-        }
-        
+    if(diff_filename) {
+        diff_configs(ctx, input_filename, diff_filename, &overrides, diff_keys_only);
         goto safe_exit;
     }
 
-    fp = fopen(input_filename, "r");
-    if(!fp)
-        die("%s", strerror(errno));
-    if(ini_parse_file(fp, &init_callback_conf, input_filename) < 0)
-        die("parse error");
-    fclose(fp);
+    if(watch_mode || socket_path)
+        stat(input_filename, &watch.input_st);
 
-    for(def = def_begin; def; def = def->next) {
-        if(def->has_value || !def->value_required)
-            continue;
-        die("key %s requires a value!", def->name);
-    }
+    if(defcon_apply_conf(ctx, input_filename) != DEFCON_OK || apply_overrides(ctx, &overrides) != DEFCON_OK)
+        die("%s", defcon_error_message(ctx));
+
+    /* A session goes on, the value may well be added in a moment */
+    missing = defcon_check(ctx) != DEFCON_OK;
+    if(missing && !watch_mode && !socket_path)
+        die("%s!", defcon_error_message(ctx));
+
+    defcon_render(ctx);
+
+    memset(&outputs, 0, sizeof(outputs));
+    outputs.ctx = ctx;
+    outputs.jobs = safe_malloc((size_t)argc * sizeof(struct output_job));
+    outputs.write_depfiles = write_depfiles;
+
+    /* Every definition file plus the input file */
+    watch.ctx = ctx;
+    watch.overrides = &overrides;
+    watch.input_filename = input_filename;
+    watch.outputs = &outputs;
+    watch.num_threads = num_threads;
+    collect_inputs(&watch);
 
     optind = 1;
     while((opt = getopt(argc, argv, opt_string)) != -1) {
         switch(opt) {
             case 'C':
-                generate_c_header(optarg);
+                outputs.jobs[outputs.num_jobs].type = OUTPUT_C_HEADER;
                 break;
             case 'M':
-                generate_makefile(optarg);
+                outputs.jobs[outputs.num_jobs].type = OUTPUT_MAKEFILE;
+                break;
+            case 'N':
+                outputs.jobs[outputs.num_jobs].type = OUTPUT_NINJA;
+                break;
+            case 'i':
+                outputs.jobs[outputs.num_jobs].type = OUTPUT_INDEX;
                 break;
+            case 'K':
+                outputs.jobs[outputs.num_jobs].type = OUTPUT_KEY_HEADERS;
+                break;
+            default:
+                continue;
+        }
+
+        outputs.jobs[outputs.num_jobs++].filename = optarg;
+    }
+
+    if(missing) {
+        report_missing_value(ctx);
+    }
+    else {
+        generate_outputs(&outputs, num_threads);
+
+        outputs_ok = true;
+        for(i = 0; i < outputs.num_jobs; i++)
+            outputs_ok = outputs_ok && outputs.jobs[i].result;
+
+        /* The fingerprint was taken before reading anything, so
+         * inputs changing during the run just cause another one */
+        if(commit_outputs() && outputs_ok && stamp_filename) {
+            if(write_file(stamp_filename, &stamp))
+                commit_outputs();
         }
     }
 
+    /* From here on only outputs whose bytes change are written */
+    if(watch_mode || socket_path)
+        update_changed_only = true;
+
+#ifdef __linux__
+    if(watch_mode)
+        watch_definitions(&watch);
+#endif
+    if(socket_path)
+        serve(&watch, socket_path, write_depfiles);
+
 safe_exit:
-    for(def = def_begin; def; def = next_def) {
-        next_def = def->next;
-        free(def);
+    commit_outputs();
+
+    if(print_statistics) {
+        defcon_get_stats(ctx, &stats);
+        lprintf("%zu definitions, %zu table slots", stats.num_defs, stats.table_size);
+        lprintf("%lu lookups, %lu probes (%.2f probes per lookup)", stats.num_lookups, stats.num_probes,
+            stats.num_lookups ? ((double)stats.num_probes / (double)stats.num_lookups) : 0.0);
+        lprintf("%zu interned strings, %zu bytes", stats.num_strings, stats.string_bytes);
+        if(snapshot_filename)
+            lprintf("%zu of %zu definition files from the snapshot", stats.num_cached_files, stats.num_files);
+        for(i = 0; i < outputs.num_jobs; i++)
+            lprintf("%s: %.3f ms", outputs.jobs[i].filename, outputs.jobs[i].milliseconds);
     }
 
+    free(headers);
+    free(overrides.defines);
+    defcon_buffer_free(&dyndep);
+    free(watch.inputs);
+    free(outputs.jobs);
+    defcon_buffer_free(&stamp);
+    defcon_destroy(ctx);
+
     return 0;
 }
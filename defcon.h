@@ -0,0 +1,178 @@
+/*
+ * Copyright (c) 2021, Kirill GPRB
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * libdefcon: everything a run owns lives in a context, so any number
+ * of contexts can be used at the same time on different threads. A
+ * single context must not be used by two threads at once, except for
+ * the functions taking a const context, which only read it.
+ *
+ * Functions returning int return DEFCON_OK or one of the errors below
+ * and leave a message for defcon_error_message. Warnings go to the
+ * handler given to defcon_set_warning_handler. Running out of memory
+ * aborts, there's no way to go on without it.
+ */
+
+#ifndef DEFCON_H
+#define DEFCON_H 1
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define DEFCON_VERSION "0.0.1"
+
+#define DEFCON_OK                   0
+#define DEFCON_ERROR_IO             1
+#define DEFCON_ERROR_UNDEFINED_KEY  2
+#define DEFCON_ERROR_REQUIRED       3
+#define DEFCON_ERROR_INVALID        4
+
+#define DEFCON_ORDER_REVERSE    0
+#define DEFCON_ORDER_FILE       1
+#define DEFCON_ORDER_NAME       2
+
+/* Files picked up from directories given as inputs */
+#define DEFCON_FILE_SUFFIX ".def"
+
+/* Keep the parsed files around for defcon_reload */
+#define DEFCON_KEEP_FILES 1
+
+struct defcon;
+struct defcon_index;
+
+/* Grows as needed and stays NUL-terminated once anything was added;
+ * a zeroed buffer is empty, defcon_buffer_free releases it */
+struct defcon_buffer {
+    char *data;
+    size_t length;
+    size_t capacity;
+};
+
+/* A rendered key; the key is mangled but doesn't include the prefix.
+ * The strings are NUL-terminated and stay valid until the context
+ * is rendered, loaded or reloaded again */
+struct defcon_key {
+    const char *name;
+    size_t name_length;
+    const char *key;
+    size_t key_length;
+    const char *value;
+    size_t value_length;
+};
+
+struct defcon_stats {
+    size_t num_defs;
+    size_t table_size;
+    unsigned long num_lookups;
+    unsigned long num_probes;
+    size_t num_strings;
+    size_t string_bytes;
+    size_t num_files;
+    size_t num_cached_files;
+};
+
+typedef void (*defcon_warning_handler)(void *data, const char *message);
+
+void defcon_buffer_append(struct defcon_buffer *sb, const char *s, size_t n);
+void defcon_buffer_putc(struct defcon_buffer *sb, char c);
+void defcon_buffer_printf(struct defcon_buffer *sb, const char *fmt, ...);
+void defcon_buffer_puts(struct defcon_buffer *sb, const char *s);
+void defcon_buffer_clear(struct defcon_buffer *sb);
+void defcon_buffer_free(struct defcon_buffer *sb);
+
+struct defcon *defcon_create(void);
+void defcon_destroy(struct defcon *ctx);
+const char *defcon_error_message(const struct defcon *ctx);
+
+/* Settings; strings are copied. Definition files are parsed on a
+ * single thread unless told otherwise, the snapshot is off and the
+ * files are read ahead with io_uring where the kernel has it */
+void defcon_set_warning_handler(struct defcon *ctx, defcon_warning_handler handler, void *data);
+void defcon_set_prefix(struct defcon *ctx, const char *prefix);
+const char *defcon_prefix(const struct defcon *ctx);
+void defcon_set_suppress_undefined(struct defcon *ctx, bool suppress);
+void defcon_set_threads(struct defcon *ctx, unsigned int num_threads);
+void defcon_set_snapshot(struct defcon *ctx, const char *filename);
+void defcon_set_file_reader(struct defcon *ctx, bool enable);
+
+/* Takes definition files, directories searched for *.def files and
+ * glob patterns, and expands them into the list of files to load */
+int defcon_set_inputs(struct defcon *ctx, char *const *args, size_t num_args);
+const char *const *defcon_files(const struct defcon *ctx, size_t *count);
+const char *const *defcon_dirs(const struct defcon *ctx, size_t *count);
+
+/* Loads the files into a fresh table. An input file given here is
+ * read along with the definitions, ahead of defcon_apply_conf */
+int defcon_load(struct defcon *ctx, const char *input_filename, unsigned int flags);
+const char *const *defcon_loaded_files(const struct defcon *ctx, size_t *count);
+
+/* Needs DEFCON_KEEP_FILES; only files that changed are parsed again.
+ * If anything changed the values are back to the defaults */
+int defcon_reload(struct defcon *ctx, bool *changed);
+
+/* Fills the buffer and returns true if the snapshot needs saving */
+bool defcon_take_snapshot(struct defcon *ctx, struct defcon_buffer *out);
+
+void defcon_sort(struct defcon *ctx, unsigned int order);
+
+/* Values are set on top of whatever they are now; defcon_set_key
+ * takes the mangled key without the prefix, as the outputs have it.
+ * defcon_reset goes back to what the definitions say */
+int defcon_apply_conf(struct defcon *ctx, const char *filename);
+int defcon_set(struct defcon *ctx, const char *name, const char *value);
+int defcon_set_key(struct defcon *ctx, const char *key, size_t length, const char *value);
+void defcon_reset(struct defcon *ctx);
+int defcon_check(struct defcon *ctx);
+int defcon_get(struct defcon *ctx, const char *name, struct defcon_buffer *value);
+
+/* Renders the keys for the functions below and returns how many
+ * values differ from the last time, which is all of them after
+ * loading or reloading */
+size_t defcon_render(struct defcon *ctx);
+size_t defcon_num_keys(const struct defcon *ctx);
+void defcon_get_key(const struct defcon *ctx, size_t index, struct defcon_key *key);
+bool defcon_find_key(const struct defcon *ctx, const char *key, size_t length, size_t *index);
+
+void defcon_format_c_header(const struct defcon *ctx, struct defcon_buffer *out);
+void defcon_format_makefile(const struct defcon *ctx, struct defcon_buffer *out);
+void defcon_format_ninja(const struct defcon *ctx, struct defcon_buffer *out);
+
+/* A hash index of the rendered values by name, for defcon_index_get;
+ * fails if the values don't fit */
+bool defcon_format_index(const struct defcon *ctx, struct defcon_buffer *out);
+void defcon_format_dump(const struct defcon *ctx, struct defcon_buffer *out);
+void defcon_format_define(const struct defcon *ctx, size_t index, struct defcon_buffer *out);
+
+void defcon_get_stats(const struct defcon *ctx, struct defcon_stats *stats);
+
+/* Indexes are mapped and used in place, opening one fails with errno
+ * set, EINVAL for anything that isn't an index of this build. A value
+ * is NUL-terminated and stays valid until the index is closed */
+struct defcon_index *defcon_index_open(const char *filename);
+void defcon_index_close(struct defcon_index *index);
+bool defcon_index_get(const struct defcon_index *index, const char *name, size_t length, const char **value, size_t *value_length);
+
+#endif
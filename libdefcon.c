@@ -0,0 +1,2889 @@
+/*
+ * Copyright (c) 2021, Kirill GPRB
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Require POSIX.1-2008 */
+#define _POSIX_C_SOURCE 200809L
+
+/* syscall(2) for the io_uring file reader */
+#ifdef __linux__
+#define _DEFAULT_SOURCE
+#endif
+
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+
+#include "defcon.h"
+
+#define VALUE_TYPE_STRING           0
+#define VALUE_TYPE_INTEGER          1
+#define VALUE_TYPE_HEX_INTEGER      2
+#define VALUE_TYPE_UNSIGNED_INTEGER 3
+#define VALUE_TYPE_BOOLEAN          4
+
+#define RECORD_TYPE         0
+#define RECORD_VALUE        1
+#define RECORD_REQUIRED     2
+#define RECORD_UNKNOWN      3
+#define RECORD_SYNTAX_ERROR 4
+
+/* A string interned in the context's string pool */
+struct defcon_string {
+    uint32_t offset;
+    uint32_t length;
+};
+
+struct defcon_value {
+    unsigned int type;
+    union {
+        struct defcon_string string;
+        intmax_t integer;
+        uintmax_t unsigned_integer;
+        bool boolean;
+    } u;
+};
+
+/* The default is what the definition files say, so the
+ * input file can be applied again without reloading them */
+struct defcon_def {
+    struct defcon_string name;
+    uint32_t hash;
+    bool has_value;
+    bool value_required;
+    bool default_has_value;
+    struct defcon_value value;
+    struct defcon_value default_value;
+    struct defcon_def *next;
+};
+
+#define ARENA_CHUNK_SIZE 65536
+
+/* Requests the file reader keeps in flight at once */
+#define READER_QUEUE_DEPTH 128
+
+/* Bumped whenever the snapshot layout or the record kinds change */
+#define SNAPSHOT_MAGIC      "defcon snapshot\n"
+#define SNAPSHOT_VERSION    2
+
+/* Bumped whenever the index layout changes */
+#define INDEX_MAGIC     "defcon key index"
+#define INDEX_VERSION   1
+
+union arena_align {
+    intmax_t integer;
+    long double floating;
+    void *pointer;
+};
+
+struct arena_chunk {
+    struct arena_chunk *next;
+    size_t size;
+    size_t used;
+    union arena_align data[];
+};
+
+struct arena {
+    struct arena_chunk *head;
+};
+
+/* Points into memory owned by someone else, not NUL-terminated */
+struct strview {
+    const char *data;
+    size_t length;
+};
+
+/* A key rendered once after resolution and shared by all outputs;
+ * the key is mangled but doesn't include the prefix. The name is a
+ * copy, the pool moves whenever a value interns a new string */
+struct rendered_key {
+    struct strview name;
+    struct strview key;
+    struct strview value;
+};
+
+struct mapped_file {
+    const char *data;
+    size_t size;
+    void *map;
+    char *buffer;
+};
+
+/* A file the reader loads ahead of time; the contents are
+ * handed over to whoever takes the file */
+struct prefetched_file {
+    const char *filename;
+    char *buffer;
+    size_t size;
+    int fd;
+    bool fallback;
+    bool done;
+};
+
+#ifdef __linux__
+struct uring {
+    int fd;
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_map;
+    void *cq_map;
+    size_t sq_map_size;
+    size_t cq_map_size;
+    size_t sqes_size;
+    unsigned int to_submit;
+};
+#endif
+
+/* Opens and reads every input with batched io_uring requests on a
+ * thread of its own while the loaders parse whatever already arrived.
+ * Files it can't handle are marked to be mapped by the taker instead */
+struct file_reader {
+    struct prefetched_file *files;
+    size_t num_files;
+#ifdef __linux__
+    struct uring ring;
+#endif
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t file_done;
+};
+
+typedef int (*ini_handler)(void *data, struct strview section, struct strview name, struct strview value);
+typedef void (*ini_error)(void *data, size_t lineno, const char *message);
+
+/* A line of a definition file that is parsed but not applied yet */
+struct def_record {
+    unsigned int kind;
+    uint32_t hash;
+    size_t lineno;
+    struct strview section;
+    struct strview name;
+    struct strview value;
+};
+
+/* Definition files are parsed into records by the loader
+ * threads and applied to the table in command line order */
+struct def_file {
+    const char *filename;
+    struct mapped_file file;
+    struct def_record *records;
+    size_t num_records;
+    size_t capacity;
+    uint64_t content_hash;
+    struct stat st;
+    int error;
+    bool cached;
+    bool stat_cacheable;
+    bool stat_matched;
+    bool done;
+};
+
+/* A snapshot is a header followed by the file entries, the records
+ * of all files and the strings they refer to. It's written in host
+ * byte order and only ever read back by the same build, so it's used
+ * in place; strings are NUL-terminated and offsets are into the
+ * string block */
+struct snapshot_header {
+    char magic[16];
+    uint32_t version;
+    uint32_t num_files;
+    uint32_t num_records;
+    uint32_t strings_size;
+};
+
+/* The stat fields are only trusted when stat_valid is set, which it
+ * isn't for files modified so shortly before the snapshot was taken
+ * that another change could have kept the same mtime */
+struct snapshot_file {
+    uint64_t content_hash;
+    uint64_t size;
+    uint64_t inode;
+    int64_t mtime_sec;
+    uint32_t mtime_nsec;
+    uint32_t stat_valid;
+    uint32_t filename_offset;
+    uint32_t filename_length;
+    uint32_t first_record;
+    uint32_t num_records;
+};
+
+struct snapshot_record {
+    uint32_t kind;
+    uint32_t hash;
+    uint32_t lineno;
+    uint32_t section_offset;
+    uint32_t section_length;
+    uint32_t name_offset;
+    uint32_t name_length;
+    uint32_t value_offset;
+    uint32_t value_length;
+};
+
+struct snapshot {
+    struct mapped_file file;
+    const struct snapshot_header *header;
+    const struct snapshot_file *files;
+    const struct snapshot_record *records;
+    const char *strings;
+};
+
+/* The snapshot of this run, built up while the files are merged */
+struct snapshot_writer {
+    struct defcon_buffer files;
+    struct defcon_buffer records;
+    struct defcon_buffer strings;
+    uint32_t num_files;
+    uint32_t num_records;
+    bool changed;
+};
+
+/* An index is a header followed by an open-addressed table of
+ * slots and the strings they refer to, in host byte order like the
+ * snapshot. The string block starts with a NUL byte, so an offset
+ * of zero marks an empty slot; values are NUL-terminated */
+struct index_header {
+    char magic[16];
+    uint32_t version;
+    uint32_t num_slots;
+    uint32_t num_keys;
+    uint32_t strings_size;
+};
+
+struct index_slot {
+    uint32_t hash;
+    uint32_t name_offset;
+    uint32_t name_length;
+    uint32_t value_offset;
+    uint32_t value_length;
+};
+
+struct defcon_index {
+    struct mapped_file file;
+    const struct index_header *header;
+    const struct index_slot *slots;
+    const char *strings;
+};
+
+/* Definition files named on the command line or found in
+ * the directories and glob patterns given there */
+struct file_list {
+    char **names;
+    size_t count;
+    size_t capacity;
+};
+
+/* The parsed files a watch session keeps around, along
+ * with the snapshot their records may point into */
+struct def_set {
+    struct def_file *files;
+    size_t num_files;
+    struct snapshot snapshot;
+    bool has_snapshot;
+};
+
+struct def_loader {
+    struct def_file *files;
+    size_t num_files;
+    size_t next_file;
+    const struct snapshot *snapshot;
+    struct file_reader *reader;
+    bool hash_contents;
+    time_t started;
+    pthread_mutex_t lock;
+    pthread_cond_t file_done;
+};
+
+/* What the callbacks get while an input file is applied */
+struct conf_parser {
+    struct defcon *ctx;
+    const char *filename;
+};
+
+/* Sorting needs the names, which are only known to the context */
+struct named_def {
+    const char *name;
+    struct defcon_def *def;
+};
+
+struct strpool_entry {
+    uint32_t hash;
+    struct defcon_string str;
+};
+
+/* Offset zero always holds the empty string, so
+ * a zero offset also marks an unused entry slot */
+struct strpool {
+    struct defcon_buffer buffer;
+    struct strpool_entry *slots;
+    size_t num_slots;
+    size_t count;
+};
+
+/* Everything a context owns: the definitions live in the arena, the
+ * table only indexes them. The inputs are kept as given so they can
+ * be expanded again on reload, the set only with DEFCON_KEEP_FILES */
+struct defcon {
+    struct arena arena;
+    struct strpool pool;
+    struct defcon_def *def_begin;
+    struct defcon_def **def_table;
+    size_t def_table_size;
+    size_t def_count;
+    struct rendered_key *keys;
+    size_t num_keys;
+    size_t *key_slots;
+    size_t num_key_slots;
+    struct defcon_buffer values;
+    unsigned long num_lookups;
+    unsigned long num_probes;
+    size_t num_cached_files;
+    struct file_list args;
+    struct file_list files;
+    struct file_list dirs;
+    const char **loaded_files;
+    size_t num_loaded_files;
+    struct def_set set;
+    bool keep_files;
+    struct file_reader reader;
+    bool use_reader;
+    bool no_reader;
+    char *reader_conf;
+    struct snapshot_writer writer;
+    char *snapshot_filename;
+    char *prefix;
+    bool suppress_undefined;
+    unsigned int num_threads;
+    unsigned int order;
+    defcon_warning_handler warning_handler;
+    void *warning_data;
+    struct defcon_buffer message;
+};
+
+/* Nothing can go on without memory and unwinding every
+ * caller wouldn't leave anything useful, so give up */
+static void *safe_malloc(size_t size)
+{
+    void *block = malloc(size);
+    if(!block)
+        abort();
+    return block;
+}
+
+static void *arena_alloc(struct arena *arena, size_t size)
+{
+    void *block = NULL;
+    size_t chunk_size;
+    struct arena_chunk *chunk = arena->head;
+
+    size = (size + sizeof(union arena_align) - 1) / sizeof(union arena_align) * sizeof(union arena_align);
+
+    if(!chunk || chunk->size - chunk->used < size) {
+        chunk_size = (size > ARENA_CHUNK_SIZE) ? size : ARENA_CHUNK_SIZE;
+        chunk = safe_malloc(sizeof(struct arena_chunk) + chunk_size);
+        chunk->next = arena->head;
+        chunk->size = chunk_size;
+        chunk->used = 0;
+        arena->head = chunk;
+    }
+
+    block = (unsigned char *)chunk->data + chunk->used;
+    chunk->used += size;
+    return block;
+}
+
+static void arena_release(struct arena *arena)
+{
+    struct arena_chunk *chunk, *next_chunk;
+    for(chunk = arena->head; chunk; chunk = next_chunk) {
+        next_chunk = chunk->next;
+        free(chunk);
+    }
+
+    arena->head = NULL;
+}
+
+static void *safe_realloc(void *block, size_t size)
+{
+    if(!(block = realloc(block, size)))
+        abort();
+    return block;
+}
+
+static void buffer_reserve(struct defcon_buffer *sb, size_t n)
+{
+    size_t capacity = sb->capacity ? sb->capacity : 256;
+
+    if(sb->length + n < sb->capacity)
+        return;
+    while(capacity <= sb->length + n)
+        capacity *= 2;
+
+    sb->data = safe_realloc(sb->data, capacity);
+    sb->capacity = capacity;
+}
+
+void defcon_buffer_append(struct defcon_buffer *sb, const char *s, size_t n)
+{
+    buffer_reserve(sb, n);
+    memcpy(sb->data + sb->length, s, n);
+    sb->length += n;
+    sb->data[sb->length] = 0;
+}
+
+void defcon_buffer_putc(struct defcon_buffer *sb, char c)
+{
+    defcon_buffer_append(sb, &c, 1);
+}
+
+void defcon_buffer_printf(struct defcon_buffer *sb, const char *fmt, ...)
+{
+    int n;
+    va_list va, vb;
+
+    va_start(va, fmt);
+    va_copy(vb, va);
+    n = vsnprintf(NULL, 0, fmt, va);
+    va_end(va);
+
+    if(n > 0) {
+        buffer_reserve(sb, (size_t)n);
+        vsnprintf(sb->data + sb->length, (size_t)n + 1, fmt, vb);
+        sb->length += (size_t)n;
+    }
+
+    va_end(vb);
+}
+
+void defcon_buffer_puts(struct defcon_buffer *sb, const char *s)
+{
+    defcon_buffer_append(sb, s, strlen(s));
+}
+
+void defcon_buffer_clear(struct defcon_buffer *sb)
+{
+    sb->length = 0;
+    if(sb->data)
+        sb->data[0] = 0;
+}
+
+void defcon_buffer_free(struct defcon_buffer *sb)
+{
+    free(sb->data);
+    sb->data = NULL;
+    sb->length = 0;
+    sb->capacity = 0;
+}
+
+static void warn(const struct defcon *ctx, const char *fmt, ...)
+{
+    va_list va;
+    char message[4096];
+
+    if(!ctx->warning_handler)
+        return;
+
+    va_start(va, fmt);
+    vsnprintf(message, sizeof(message), fmt, va);
+    va_end(va);
+    ctx->warning_handler(ctx->warning_data, message);
+}
+
+/* Keeps the message for defcon_error_message and passes the error on */
+static int fail(struct defcon *ctx, int error, const char *fmt, ...)
+{
+    va_list va;
+    char message[4096];
+
+    va_start(va, fmt);
+    vsnprintf(message, sizeof(message), fmt, va);
+    va_end(va);
+
+    defcon_buffer_clear(&ctx->message);
+    defcon_buffer_puts(&ctx->message, message);
+    return error;
+}
+
+/* 32-bit FNV-1a */
+static uint32_t hash_string(const char *s, size_t n)
+{
+    uint32_t hash = UINT32_C(2166136261);
+    while(n--) {
+        hash ^= (unsigned char)(*s++);
+        hash *= UINT32_C(16777619);
+    }
+    return hash;
+}
+
+/* 64-bit FNV-1a */
+static uint64_t hash64(uint64_t hash, const void *data, size_t n)
+{
+    const unsigned char *p = data;
+    while(n--) {
+        hash ^= *p++;
+        hash *= UINT64_C(1099511628211);
+    }
+    return hash;
+}
+
+static const char *strpool_str(const struct strpool *pool, struct defcon_string str)
+{
+    return pool->buffer.data + str.offset;
+}
+
+/* Returns either the entry holding the string
+ * or the empty entry where it should be inserted */
+static struct strpool_entry *strpool_slot(const struct strpool *pool, const char *s, size_t n, uint32_t hash)
+{
+    size_t mask = pool->num_slots - 1;
+    size_t i = hash & mask;
+    struct strpool_entry *entry = NULL;
+
+    for(;; i = (i + 1) & mask) {
+        entry = &pool->slots[i];
+        if(!entry->str.offset)
+            return entry;
+        if(entry->hash == hash && entry->str.length == n && !memcmp(strpool_str(pool, entry->str), s, n))
+            return entry;
+    }
+}
+
+static void strpool_grow(struct strpool *pool)
+{
+    size_t i, j, mask, old_size = pool->num_slots;
+    struct strpool_entry *old_slots = pool->slots;
+
+    pool->num_slots = old_size ? (old_size * 2) : 256;
+    pool->slots = safe_malloc(pool->num_slots * sizeof(struct strpool_entry));
+    memset(pool->slots, 0, pool->num_slots * sizeof(struct strpool_entry));
+
+    mask = pool->num_slots - 1;
+    for(i = 0; i < old_size; i++) {
+        if(!old_slots[i].str.offset)
+            continue;
+        for(j = old_slots[i].hash & mask; pool->slots[j].str.offset; j = (j + 1) & mask);
+        pool->slots[j] = old_slots[i];
+    }
+
+    free(old_slots);
+}
+
+static struct defcon_string strpool_intern(struct strpool *pool, const char *s, size_t n, uint32_t hash)
+{
+    struct strpool_entry *entry = NULL;
+    struct defcon_string str = { 0, 0 };
+
+    if(!pool->buffer.length)
+        defcon_buffer_putc(&pool->buffer, 0);
+    if(!n)
+        return str;
+
+    /* Keep the load factor below 3/4 */
+    if((pool->count + 1) * 4 > pool->num_slots * 3)
+        strpool_grow(pool);
+
+    entry = strpool_slot(pool, s, n, hash);
+    if(entry->str.offset)
+        return entry->str;
+
+    /* Offsets are 32 bits, there's no way to refer to more */
+    if(pool->buffer.length + n + 1 > UINT32_MAX)
+        abort();
+
+    entry->hash = hash;
+    entry->str.offset = (uint32_t)pool->buffer.length;
+    entry->str.length = (uint32_t)n;
+    defcon_buffer_append(&pool->buffer, s, n);
+    defcon_buffer_putc(&pool->buffer, 0);
+    pool->count++;
+
+    return entry->str;
+}
+
+static bool strpool_find(const struct strpool *pool, const char *s, size_t n, uint32_t hash, struct defcon_string *str)
+{
+    struct strpool_entry *entry = NULL;
+
+    if(!n) {
+        str->offset = 0;
+        str->length = 0;
+        return pool->buffer.length != 0;
+    }
+
+    if(!pool->num_slots)
+        return false;
+
+    entry = strpool_slot(pool, s, n, hash);
+    if(!entry->str.offset)
+        return false;
+
+    *str = entry->str;
+    return true;
+}
+
+static void strpool_free(struct strpool *pool)
+{
+    defcon_buffer_free(&pool->buffer);
+    free(pool->slots);
+    pool->slots = NULL;
+    pool->num_slots = 0;
+    pool->count = 0;
+}
+
+static bool view_equals(struct strview v, const char *s)
+{
+    return v.length == strlen(s) && !memcmp(v.data, s, v.length);
+}
+
+/* Numbers are short; anything that doesn't
+ * fit can't be parsed as one anyway */
+static const char *view_cstr(struct strview v, char *s, size_t n)
+{
+    if(v.length < n)
+        n = v.length + 1;
+    memcpy(s, v.data, n - 1);
+    s[n - 1] = 0;
+    return s;
+}
+
+static struct strview arena_strview(struct arena *arena, const char *s, size_t n)
+{
+    struct strview v;
+    char *data = arena_alloc(arena, n + 1);
+    memcpy(data, s, n);
+    data[n] = 0;
+    v.data = data;
+    v.length = n;
+    return v;
+}
+
+static bool parse_boolean(struct strview v)
+{
+    char s[128];
+    return atoi(view_cstr(v, s, sizeof(s))) || view_equals(v, "true");
+}
+
+static unsigned int parse_type(struct strview v)
+{
+    if(view_equals(v, "string"))
+        return VALUE_TYPE_STRING;
+    if(view_equals(v, "integer"))
+        return VALUE_TYPE_INTEGER;
+    if(view_equals(v, "hex_integer"))
+        return VALUE_TYPE_HEX_INTEGER;
+    if(view_equals(v, "unsigned_integer"))
+        return VALUE_TYPE_UNSIGNED_INTEGER;
+    if(view_equals(v, "boolean"))
+        return VALUE_TYPE_BOOLEAN;
+    return VALUE_TYPE_STRING;
+}
+
+static void parse_value(struct defcon *ctx, struct strview sv, struct defcon_value *v, bool *success)
+{
+    char s[128];
+    bool result = false;
+
+    if(v->type != VALUE_TYPE_STRING)
+        view_cstr(sv, s, sizeof(s));
+
+    switch(v->type) {
+        case VALUE_TYPE_INTEGER:
+            result = sscanf(s, "%" SCNdMAX, &v->u.integer) == 1;
+            break;
+        case VALUE_TYPE_HEX_INTEGER:
+            result = sscanf(s, "0x%" SCNxMAX, &v->u.unsigned_integer) == 1;
+            break;
+        case VALUE_TYPE_UNSIGNED_INTEGER:
+            result = sscanf(s, "%" SCNuMAX, &v->u.unsigned_integer) == 1;
+            break;
+        case VALUE_TYPE_BOOLEAN:
+            v->u.boolean = parse_boolean(sv);
+            result = true;
+            break;
+        default:
+            v->u.string = strpool_intern(&ctx->pool, sv.data, sv.length, hash_string(sv.data, sv.length));
+            result = v->type == VALUE_TYPE_STRING;
+            break;
+    }
+
+    if(!success)
+        return;
+    *success = result;
+}
+
+/* Returns either the slot holding the definition
+ * or the empty slot where it should be inserted */
+static struct defcon_def **find_slot(struct defcon *ctx, struct defcon_string name, uint32_t hash)
+{
+    size_t mask = ctx->def_table_size - 1;
+    size_t i = hash & mask;
+
+    ctx->num_lookups++;
+    for(;; i = (i + 1) & mask) {
+        ctx->num_probes++;
+        if(!ctx->def_table[i])
+            return &ctx->def_table[i];
+        /* Interned names are equal only if their offsets are */
+        if(ctx->def_table[i]->name.offset == name.offset)
+            return &ctx->def_table[i];
+    }
+}
+
+static void grow_def_table(struct defcon *ctx)
+{
+    size_t i, j, mask, old_size = ctx->def_table_size;
+    struct defcon_def **old_table = ctx->def_table;
+
+    ctx->def_table_size = old_size ? (old_size * 2) : 64;
+    ctx->def_table = safe_malloc(ctx->def_table_size * sizeof(struct defcon_def *));
+    memset(ctx->def_table, 0, ctx->def_table_size * sizeof(struct defcon_def *));
+
+    mask = ctx->def_table_size - 1;
+    for(i = 0; i < old_size; i++) {
+        if(!old_table[i])
+            continue;
+        for(j = old_table[i]->hash & mask; ctx->def_table[j]; j = (j + 1) & mask);
+        ctx->def_table[j] = old_table[i];
+    }
+
+    free(old_table);
+}
+
+static struct defcon_def *get_def(struct defcon *ctx, struct strview v, uint32_t hash)
+{
+    struct defcon_string name = strpool_intern(&ctx->pool, v.data, v.length, hash);
+    struct defcon_def *def = NULL, **slot = NULL;
+
+    /* Keep the load factor below 3/4 */
+    if((ctx->def_count + 1) * 4 > ctx->def_table_size * 3)
+        grow_def_table(ctx);
+
+    slot = find_slot(ctx, name, hash);
+    if(*slot)
+        return *slot;
+
+    def = arena_alloc(&ctx->arena, sizeof(struct defcon_def));
+    memset(def, 0, sizeof(struct defcon_def));
+    def->name = name;
+    def->hash = hash;
+    def->value.type = VALUE_TYPE_STRING;
+
+    def->next = ctx->def_begin;
+    ctx->def_begin = def;
+
+    *slot = def;
+    ctx->def_count++;
+
+    return def;
+}
+
+static struct defcon_def *find_def(struct defcon *ctx, struct strview v)
+{
+    uint32_t hash = hash_string(v.data, v.length);
+    struct defcon_string name;
+
+    /* A name that was never interned can't be defined */
+    if(!ctx->def_table_size || !strpool_find(&ctx->pool, v.data, v.length, hash, &name))
+        return NULL;
+    return *find_slot(ctx, name, hash);
+}
+
+static struct def_record *push_record(struct def_file *file, unsigned int kind)
+{
+    struct def_record *rec = NULL;
+
+    if(file->num_records >= file->capacity) {
+        file->capacity = file->capacity ? (file->capacity * 2) : 256;
+        file->records = safe_realloc(file->records, file->capacity * sizeof(struct def_record));
+    }
+
+    rec = &file->records[file->num_records++];
+    memset(rec, 0, sizeof(struct def_record));
+    rec->kind = kind;
+    return rec;
+}
+
+/* Runs on the loader threads, so it must not touch the context */
+static int ini_callback_def(void *data, struct strview section, struct strview name, struct strview value)
+{
+    struct def_file *file = data;
+    struct def_record *rec = NULL;
+    const struct def_record *prev = NULL;
+    unsigned int kind = RECORD_UNKNOWN;
+    uint32_t hash;
+
+    if(view_equals(name, "type"))
+        kind = RECORD_TYPE;
+    else if(view_equals(name, "value"))
+        kind = RECORD_VALUE;
+    else if(view_equals(name, "required"))
+        kind = RECORD_REQUIRED;
+
+    if(file->num_records)
+        prev = &file->records[file->num_records - 1];
+
+    /* Section views of consecutive lines point at the
+     * same bytes, so there's no need to hash them again */
+    if(prev && prev->section.data == section.data && prev->kind != RECORD_SYNTAX_ERROR)
+        hash = prev->hash;
+    else
+        hash = hash_string(section.data, section.length);
+
+    rec = push_record(file, kind);
+    rec->hash = hash;
+    rec->section = section;
+    rec->name = name;
+    rec->value = value;
+
+    return kind != RECORD_UNKNOWN;
+}
+
+static void ini_error_def(void *data, size_t lineno, const char *message)
+{
+    struct def_record *rec = push_record(data, RECORD_SYNTAX_ERROR);
+    rec->lineno = lineno;
+    rec->value.data = message;
+    rec->value.length = strlen(message);
+}
+
+/* Files merged again without being parsed again are quiet,
+ * their warnings were already shown the first time */
+static void merge_def_file(struct defcon *ctx, const struct def_file *file, bool quiet)
+{
+    size_t i;
+    const struct def_record *rec = NULL;
+    struct defcon_def *def = NULL;
+    const char *section_data = NULL;
+
+    for(i = 0; i < file->num_records; i++) {
+        rec = &file->records[i];
+
+        if(rec->kind == RECORD_SYNTAX_ERROR) {
+            if(!quiet)
+                warn(ctx, "%s:%zu: warning: %s", file->filename, rec->lineno, rec->value.data);
+            continue;
+        }
+
+        if(!def || section_data != rec->section.data) {
+            def = get_def(ctx, rec->section, rec->hash);
+            section_data = rec->section.data;
+        }
+
+        switch(rec->kind) {
+            case RECORD_TYPE:
+                def->value.type = parse_type(rec->value);
+                break;
+            case RECORD_VALUE:
+                parse_value(ctx, rec->value, &def->value, &def->has_value);
+                break;
+            case RECORD_REQUIRED:
+                def->value_required = parse_boolean(rec->value);
+                break;
+            default:
+                if(quiet)
+                    break;
+                warn(ctx, "%s: %.*s: warning: unknown key: %.*s", file->filename,
+                    (int)rec->section.length, rec->section.data, (int)rec->name.length, rec->name.data);
+                break;
+        }
+    }
+}
+
+static int init_callback_conf(void *data, struct strview section, struct strview name, struct strview value)
+{
+    const struct conf_parser *parser = data;
+    struct defcon *ctx = parser->ctx;
+    struct defcon_def *def = NULL;
+
+    if(!(def = find_def(ctx, name))) {
+        if(!ctx->suppress_undefined)
+            warn(ctx, "%s: warning: undefined key: %.*s", parser->filename, (int)name.length, name.data);
+        return 0;
+    }
+
+    parse_value(ctx, value, &def->value, &def->has_value);
+    if(!def->has_value) {
+        warn(ctx, "%s: %.*s: warning: unable to parse: %.*s", parser->filename, (int)name.length, name.data, (int)value.length, value.data);
+        return 0;
+    }
+
+    return 1;
+}
+
+static bool map_file(const char *filename, struct mapped_file *file)
+{
+    int fd, saved_errno;
+    ssize_t n;
+    struct stat st;
+    char buffer[4096];
+    struct defcon_buffer sb = { 0 };
+
+    memset(file, 0, sizeof(struct mapped_file));
+    file->data = "";
+
+    if((fd = open(filename, O_RDONLY)) < 0)
+        return false;
+
+    if(fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        file->map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(file->map != MAP_FAILED) {
+            file->data = file->map;
+            file->size = (size_t)st.st_size;
+            close(fd);
+            return true;
+        }
+
+        file->map = NULL;
+    }
+
+    /* Pipes and other things that can't be mapped */
+    while((n = read(fd, buffer, sizeof(buffer))) > 0)
+        defcon_buffer_append(&sb, buffer, (size_t)n);
+
+    if(n < 0) {
+        saved_errno = errno;
+        defcon_buffer_free(&sb);
+        close(fd);
+        errno = saved_errno;
+        return false;
+    }
+
+    if(sb.data) {
+        file->buffer = sb.data;
+        file->data = sb.data;
+        file->size = sb.length;
+    }
+
+    close(fd);
+    return true;
+}
+
+static void unmap_file(struct mapped_file *file)
+{
+    if(file->map)
+        munmap(file->map, file->size);
+    free(file->buffer);
+    memset(file, 0, sizeof(struct mapped_file));
+}
+
+#ifdef __linux__
+static bool uring_init(struct uring *ring, unsigned int entries)
+{
+    struct io_uring_params params;
+    char *sq = NULL;
+
+    memset(ring, 0, sizeof(struct uring));
+    memset(&params, 0, sizeof(params));
+
+    if((ring->fd = (int)syscall(__NR_io_uring_setup, entries, &params)) < 0)
+        return false;
+
+    ring->sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    ring->cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if(params.features & IORING_FEAT_SINGLE_MMAP) {
+        if(ring->cq_map_size > ring->sq_map_size)
+            ring->sq_map_size = ring->cq_map_size;
+        ring->cq_map_size = 0;
+    }
+
+    ring->sq_map = mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED, ring->fd, IORING_OFF_SQ_RING);
+    if(ring->sq_map == MAP_FAILED)
+        goto fail;
+
+    ring->cq_map = ring->sq_map;
+    if(ring->cq_map_size) {
+        ring->cq_map = mmap(NULL, ring->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED, ring->fd, IORING_OFF_CQ_RING);
+        if(ring->cq_map == MAP_FAILED)
+            goto fail;
+    }
+
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED, ring->fd, IORING_OFF_SQES);
+    if(ring->sqes == MAP_FAILED)
+        goto fail;
+
+    sq = ring->sq_map;
+    ring->sq_head = (unsigned int *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned int *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned int *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned int *)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned int *)((char *)ring->cq_map + params.cq_off.head);
+    ring->cq_tail = (unsigned int *)((char *)ring->cq_map + params.cq_off.tail);
+    ring->cq_mask = (unsigned int *)((char *)ring->cq_map + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_map + params.cq_off.cqes);
+    return true;
+
+fail:
+    if(ring->sqes && ring->sqes != MAP_FAILED)
+        munmap(ring->sqes, ring->sqes_size);
+    if(ring->cq_map_size && ring->cq_map && ring->cq_map != MAP_FAILED)
+        munmap(ring->cq_map, ring->cq_map_size);
+    if(ring->sq_map && ring->sq_map != MAP_FAILED)
+        munmap(ring->sq_map, ring->sq_map_size);
+    close(ring->fd);
+    return false;
+}
+
+/* Kernels before 5.6 set up a ring but fail every open and read,
+ * they don't know the probe either */
+static bool uring_probe(struct uring *ring)
+{
+    bool supported = false;
+    size_t size = sizeof(struct io_uring_probe) + IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = safe_malloc(size);
+
+    memset(probe, 0, size);
+    if(syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) == 0) {
+        supported = probe->last_op >= IORING_OP_OPENAT && probe->last_op >= IORING_OP_READ &&
+            (probe->ops[IORING_OP_OPENAT].flags & IO_URING_OP_SUPPORTED) &&
+            (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED);
+    }
+
+    free(probe);
+    return supported;
+}
+
+static void uring_free(struct uring *ring)
+{
+    munmap(ring->sqes, ring->sqes_size);
+    if(ring->cq_map_size)
+        munmap(ring->cq_map, ring->cq_map_size);
+    munmap(ring->sq_map, ring->sq_map_size);
+    close(ring->fd);
+}
+
+/* The caller keeps at most as many requests in flight as there are
+ * entries, so there's always room for another one */
+static struct io_uring_sqe *uring_get_sqe(struct uring *ring, uint64_t user_data)
+{
+    unsigned int tail = *ring->sq_tail;
+    unsigned int index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->user_data = user_data;
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->to_submit++;
+    return sqe;
+}
+
+static bool uring_submit_and_wait(struct uring *ring)
+{
+    long n;
+
+    do {
+        n = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+    } while(n < 0 && errno == EINTR);
+
+    if(n < 0)
+        return false;
+    ring->to_submit -= (unsigned int)n;
+    return true;
+}
+
+#define READER_OP_OPEN  0
+#define READER_OP_READ  1
+
+static void reader_finish(struct file_reader *reader, struct prefetched_file *file)
+{
+    pthread_mutex_lock(&reader->lock);
+    file->done = true;
+    pthread_cond_broadcast(&reader->file_done);
+    pthread_mutex_unlock(&reader->lock);
+}
+
+/* Reads one byte more than the file should have, so a file
+ * that grew in the meantime is noticed and mapped instead */
+static bool reader_queue_read(struct file_reader *reader, size_t index)
+{
+    struct stat st;
+    struct io_uring_sqe *sqe = NULL;
+    struct prefetched_file *file = &reader->files[index];
+
+    if(fstat(file->fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size <= 0 || (uintmax_t)st.st_size >= UINT32_MAX) {
+        close(file->fd);
+        file->fallback = true;
+        reader_finish(reader, file);
+        return false;
+    }
+
+    file->size = (size_t)st.st_size;
+    file->buffer = safe_malloc(file->size + 1);
+
+    sqe = uring_get_sqe(&reader->ring, ((uint64_t)index << 1) | READER_OP_READ);
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = file->fd;
+    sqe->addr = (uint64_t)(uintptr_t)file->buffer;
+    sqe->len = (uint32_t)(file->size + 1);
+    sqe->off = 0;
+    return true;
+}
+
+static void reader_complete(struct file_reader *reader, uint64_t user_data, int res, size_t *in_flight)
+{
+    size_t index = (size_t)(user_data >> 1);
+    struct prefetched_file *file = &reader->files[index];
+
+    if((user_data & 1) == READER_OP_OPEN) {
+        /* map_file tries again and reports the error, whatever
+         * the ring had to say about it */
+        if(res < 0) {
+            file->fallback = true;
+            (*in_flight)--;
+            reader_finish(reader, file);
+            return;
+        }
+
+        /* The read takes over the slot of the open */
+        file->fd = res;
+        if(!reader_queue_read(reader, index))
+            (*in_flight)--;
+        return;
+    }
+
+    close(file->fd);
+    (*in_flight)--;
+
+    /* Anything but the size fstat gave, short reads included */
+    if(res < 0 || (size_t)res != file->size) {
+        free(file->buffer);
+        file->buffer = NULL;
+        file->fallback = true;
+    }
+    else
+        file->buffer[file->size] = 0;
+
+    reader_finish(reader, file);
+}
+
+static void *file_reader_thread(void *arg)
+{
+    size_t i, next_open = 0, in_flight = 0;
+    unsigned int head, tail;
+    struct file_reader *reader = arg;
+    struct uring *ring = &reader->ring;
+    struct io_uring_sqe *sqe = NULL;
+    struct io_uring_cqe *cqe = NULL;
+
+    while(next_open < reader->num_files || in_flight) {
+        for(; next_open < reader->num_files && in_flight < READER_QUEUE_DEPTH; next_open++, in_flight++) {
+            sqe = uring_get_sqe(ring, ((uint64_t)next_open << 1) | READER_OP_OPEN);
+            sqe->opcode = IORING_OP_OPENAT;
+            sqe->fd = AT_FDCWD;
+            sqe->addr = (uint64_t)(uintptr_t)reader->files[next_open].filename;
+            sqe->open_flags = O_RDONLY | O_CLOEXEC;
+        }
+
+        if(!uring_submit_and_wait(ring))
+            break;
+
+        head = *ring->cq_head;
+        tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        for(; head != tail; head++) {
+            cqe = &ring->cqes[head & *ring->cq_mask];
+            reader_complete(reader, cqe->user_data, cqe->res, &in_flight);
+        }
+
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    /* The ring broke down, whatever is left is mapped by the takers */
+    pthread_mutex_lock(&reader->lock);
+    for(i = 0; i < reader->num_files; i++) {
+        if(!reader->files[i].done) {
+            reader->files[i].fallback = true;
+            reader->files[i].done = true;
+        }
+    }
+
+    pthread_cond_broadcast(&reader->file_done);
+    pthread_mutex_unlock(&reader->lock);
+    return NULL;
+}
+#endif
+
+/* Returns false if io_uring isn't there, the caller
+ * then reads the files itself just like before */
+static bool start_file_reader(struct file_reader *reader, const char **filenames, size_t num_files)
+{
+#ifdef __linux__
+    size_t i;
+
+    memset(reader, 0, sizeof(struct file_reader));
+    if(!num_files || !uring_init(&reader->ring, READER_QUEUE_DEPTH))
+        return false;
+    if(!uring_probe(&reader->ring)) {
+        uring_free(&reader->ring);
+        memset(reader, 0, sizeof(struct file_reader));
+        return false;
+    }
+
+    reader->files = safe_malloc(num_files * sizeof(struct prefetched_file));
+    memset(reader->files, 0, num_files * sizeof(struct prefetched_file));
+    reader->num_files = num_files;
+    for(i = 0; i < num_files; i++)
+        reader->files[i].filename = filenames[i];
+
+    pthread_mutex_init(&reader->lock, NULL);
+    pthread_cond_init(&reader->file_done, NULL);
+    if(!pthread_create(&reader->thread, NULL, &file_reader_thread, reader))
+        return true;
+
+    pthread_cond_destroy(&reader->file_done);
+    pthread_mutex_destroy(&reader->lock);
+    uring_free(&reader->ring);
+    free(reader->files);
+#else
+    (void)filenames;
+    (void)num_files;
+#endif
+    memset(reader, 0, sizeof(struct file_reader));
+    return false;
+}
+
+static void stop_file_reader(struct file_reader *reader)
+{
+#ifdef __linux__
+    size_t i;
+
+    pthread_join(reader->thread, NULL);
+    pthread_cond_destroy(&reader->file_done);
+    pthread_mutex_destroy(&reader->lock);
+    uring_free(&reader->ring);
+    for(i = 0; i < reader->num_files; i++)
+        free(reader->files[i].buffer);
+    free(reader->files);
+#endif
+    memset(reader, 0, sizeof(struct file_reader));
+}
+
+/* Same contract as map_file, the file is given by its position */
+static bool take_file(struct file_reader *reader, size_t index, struct mapped_file *file)
+{
+    struct prefetched_file *src = &reader->files[index];
+
+    pthread_mutex_lock(&reader->lock);
+    while(!src->done)
+        pthread_cond_wait(&reader->file_done, &reader->lock);
+    pthread_mutex_unlock(&reader->lock);
+
+    if(src->fallback)
+        return map_file(src->filename, file);
+
+    memset(file, 0, sizeof(struct mapped_file));
+    file->buffer = src->buffer;
+    file->data = src->buffer;
+    file->size = src->size;
+    src->buffer = NULL;
+    return true;
+}
+
+/* Stops at the first of the chars or at a ';' following whitespace */
+static const char *find_chars_or_comment(const char *s, const char *end, const char *chars)
+{
+    bool was_space = false;
+    while(s < end && (!chars || !memchr(chars, *s, strlen(chars))) && !(was_space && *s == ';')) {
+        was_space = isspace((unsigned char)(*s));
+        s++;
+    }
+
+    return s;
+}
+
+static struct strview make_view(const char *begin, const char *end)
+{
+    struct strview v;
+    while(begin < end && isspace((unsigned char)(*begin)))
+        begin++;
+    while(end > begin && isspace((unsigned char)end[-1]))
+        end--;
+    v.data = begin;
+    v.length = (size_t)(end - begin);
+    return v;
+}
+
+/* Parses the text in place with the same rules inih follows by
+ * default: lines starting with ';' or '#' are comments, a ';' after
+ * whitespace starts an inline comment, '=' or ':' separate names from
+ * values and indented lines continue the previous value. Names, values
+ * and sections are handed out as views into the text. Returns the
+ * number of the first line with an error or zero */
+static size_t ini_parse(const char *s, size_t n, ini_handler handler, ini_error error_handler, void *data)
+{
+    const char *end = s + n, *line, *line_end, *start, *stop, *p;
+    struct strview section = { "", 0 }, name = { NULL, 0 }, value, trimmed;
+    size_t lineno = 0, error = 0;
+
+    if(n >= 3 && !memcmp(s, "\xEF\xBB\xBF", 3))
+        s += 3;
+
+    for(line = s; line < end; line = line_end + 1) {
+        lineno++;
+
+        if(!(line_end = memchr(line, '\n', (size_t)(end - line))))
+            line_end = end;
+
+        trimmed = make_view(line, line_end);
+        start = trimmed.data;
+        stop = start + trimmed.length;
+
+        if(start == stop || *start == ';' || *start == '#')
+            continue;
+
+        if(name.data && start > line) {
+            value = make_view(start, find_chars_or_comment(start, stop, NULL));
+            if(!handler(data, section, name, value) && !error)
+                error = lineno;
+            continue;
+        }
+
+        if(*start == '[') {
+            p = find_chars_or_comment(start + 1, stop, "]");
+            if(p < stop && *p == ']') {
+                section.data = start + 1;
+                section.length = (size_t)(p - start - 1);
+                name.data = NULL;
+                continue;
+            }
+
+            error_handler(data, lineno, "no ']' after section name");
+            if(!error)
+                error = lineno;
+            continue;
+        }
+
+        p = find_chars_or_comment(start, stop, "=:");
+        if(p < stop && (*p == '=' || *p == ':')) {
+            name = make_view(start, p);
+            value = make_view(p + 1, find_chars_or_comment(p + 1, stop, NULL));
+            if(!handler(data, section, name, value) && !error)
+                error = lineno;
+            continue;
+        }
+
+        error_handler(data, lineno, "no '=' or ':' after name");
+        if(!error)
+            error = lineno;
+    }
+
+    return error;
+}
+
+static void ini_error_conf(void *data, size_t lineno, const char *message)
+{
+    const struct conf_parser *parser = data;
+    warn(parser->ctx, "%s:%zu: warning: %s", parser->filename, lineno, message);
+}
+
+static bool parse_conf_file(struct defcon *ctx, const char *filename, struct file_reader *reader, size_t index)
+{
+    struct mapped_file file;
+    struct conf_parser parser;
+
+    if(!(reader ? take_file(reader, index, &file) : map_file(filename, &file)))
+        return false;
+
+    parser.ctx = ctx;
+    parser.filename = filename;
+    ini_parse(file.data, file.size, &init_callback_conf, &ini_error_conf, &parser);
+    unmap_file(&file);
+    return true;
+}
+
+/* Word at a time, so telling whether a file changed costs a lot
+ * less than parsing it; this doesn't have to resist attacks */
+static uint64_t hash_content(const char *s, size_t n)
+{
+    uint64_t word, hash = UINT64_C(14695981039346656037) ^ (uint64_t)n;
+
+    for(; n >= sizeof(word); s += sizeof(word), n -= sizeof(word)) {
+        memcpy(&word, s, sizeof(word));
+        hash = (hash ^ word) * UINT64_C(0x9E3779B97F4A7C15);
+        hash ^= hash >> 32;
+    }
+
+    return hash64(hash, s, n);
+}
+
+static bool snapshot_string_valid(const struct snapshot *snapshot, uint32_t offset, uint32_t length)
+{
+    return offset < snapshot->header->strings_size && length < snapshot->header->strings_size - offset;
+}
+
+static bool snapshot_valid(const struct snapshot *snapshot)
+{
+    size_t i;
+    const struct snapshot_header *header = snapshot->header;
+    const struct snapshot_file *file = NULL;
+    const struct snapshot_record *rec = NULL;
+
+    if(snapshot->file.size < sizeof(struct snapshot_header))
+        return false;
+    if(memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) || header->version != SNAPSHOT_VERSION)
+        return false;
+    if(snapshot->file.size != sizeof(struct snapshot_header) + (size_t)header->num_files * sizeof(struct snapshot_file) +
+        (size_t)header->num_records * sizeof(struct snapshot_record) + header->strings_size)
+        return false;
+    if(header->strings_size && snapshot->strings[header->strings_size - 1])
+        return false;
+
+    for(i = 0; i < header->num_files; i++) {
+        file = &snapshot->files[i];
+        if(file->first_record > header->num_records || file->num_records > header->num_records - file->first_record)
+            return false;
+        if(!snapshot_string_valid(snapshot, file->filename_offset, file->filename_length))
+            return false;
+    }
+
+    for(i = 0; i < header->num_records; i++) {
+        rec = &snapshot->records[i];
+        if(rec->kind > RECORD_SYNTAX_ERROR)
+            return false;
+        if(!snapshot_string_valid(snapshot, rec->section_offset, rec->section_length) ||
+            !snapshot_string_valid(snapshot, rec->name_offset, rec->name_length) ||
+            !snapshot_string_valid(snapshot, rec->value_offset, rec->value_length))
+            return false;
+    }
+
+    return true;
+}
+
+/* A missing snapshot is the normal first run, anything
+ * unusable is reported and then treated the same way */
+static bool open_snapshot(const struct defcon *ctx, const char *filename, struct snapshot *snapshot)
+{
+    const char *data;
+
+    memset(snapshot, 0, sizeof(struct snapshot));
+    if(!map_file(filename, &snapshot->file)) {
+        if(errno != ENOENT)
+            warn(ctx, "%s: warning: %s", filename, strerror(errno));
+        return false;
+    }
+
+    data = snapshot->file.data;
+    snapshot->header = (const struct snapshot_header *)data;
+    data += sizeof(struct snapshot_header);
+    snapshot->files = (const struct snapshot_file *)data;
+    if(snapshot->file.size >= sizeof(struct snapshot_header)) {
+        data += (size_t)snapshot->header->num_files * sizeof(struct snapshot_file);
+        snapshot->records = (const struct snapshot_record *)data;
+        data += (size_t)snapshot->header->num_records * sizeof(struct snapshot_record);
+        snapshot->strings = data;
+    }
+
+    if(!snapshot_valid(snapshot)) {
+        warn(ctx, "%s: warning: ignoring invalid or outdated snapshot", filename);
+        unmap_file(&snapshot->file);
+        memset(snapshot, 0, sizeof(struct snapshot));
+        return false;
+    }
+
+    return true;
+}
+
+static void close_snapshot(struct snapshot *snapshot)
+{
+    unmap_file(&snapshot->file);
+    memset(snapshot, 0, sizeof(struct snapshot));
+}
+
+static struct strview snapshot_view(const struct snapshot *snapshot, uint32_t offset, uint32_t length)
+{
+    struct strview v;
+    v.data = snapshot->strings + offset;
+    v.length = length;
+    return v;
+}
+
+/* Either the stat data or, once the file is mapped, the contents */
+static bool snapshot_file_matches(const struct snapshot *snapshot, const struct snapshot_file *entry, const struct def_file *file, bool by_stat)
+{
+    size_t filename_length = strlen(file->filename);
+
+    if(by_stat) {
+        if(!entry->stat_valid || entry->size != (uint64_t)file->st.st_size || entry->inode != (uint64_t)file->st.st_ino)
+            return false;
+        if(entry->mtime_sec != (int64_t)file->st.st_mtim.tv_sec || entry->mtime_nsec != (uint32_t)file->st.st_mtim.tv_nsec)
+            return false;
+    }
+    else if(entry->content_hash != file->content_hash || entry->size != (uint64_t)file->file.size) {
+        return false;
+    }
+
+    return entry->filename_length == filename_length && !memcmp(snapshot->strings + entry->filename_offset, file->filename, filename_length);
+}
+
+/* Files usually come in the same order as last time,
+ * so the entry at the same position is tried first */
+static const struct snapshot_file *find_snapshot_file(const struct snapshot *snapshot, size_t hint, const struct def_file *file, bool by_stat)
+{
+    size_t i;
+
+    if(hint < snapshot->header->num_files && snapshot_file_matches(snapshot, &snapshot->files[hint], file, by_stat))
+        return &snapshot->files[hint];
+
+    for(i = 0; i < snapshot->header->num_files; i++) {
+        if(snapshot_file_matches(snapshot, &snapshot->files[i], file, by_stat))
+            return &snapshot->files[i];
+    }
+
+    return NULL;
+}
+
+/* Turns the snapshot records back into the records parsing the
+ * file would give; the views point into the mapped snapshot */
+static bool load_snapshot_file(const struct snapshot *snapshot, size_t hint, struct def_file *file, bool by_stat)
+{
+    size_t i;
+    const struct snapshot_file *entry = find_snapshot_file(snapshot, hint, file, by_stat);
+    const struct snapshot_record *src = NULL;
+    struct def_record *rec = NULL;
+
+    if(!entry)
+        return false;
+
+    file->content_hash = entry->content_hash;
+
+    for(i = 0; i < entry->num_records; i++) {
+        src = &snapshot->records[entry->first_record + i];
+        rec = push_record(file, src->kind);
+        rec->hash = src->hash;
+        rec->lineno = src->lineno;
+        rec->section = snapshot_view(snapshot, src->section_offset, src->section_length);
+        rec->name = snapshot_view(snapshot, src->name_offset, src->name_length);
+        rec->value = snapshot_view(snapshot, src->value_offset, src->value_length);
+    }
+
+    return true;
+}
+
+static uint32_t snapshot_add_string(struct snapshot_writer *writer, struct strview v)
+{
+    uint32_t offset = (uint32_t)writer->strings.length;
+    if(v.length)
+        defcon_buffer_append(&writer->strings, v.data, v.length);
+    defcon_buffer_putc(&writer->strings, 0);
+    return offset;
+}
+
+/* Consecutive records of a section share its bytes, which
+ * merge_def_file relies on, so they share the string too */
+static void snapshot_add_file(struct snapshot_writer *writer, const struct def_file *file)
+{
+    size_t i;
+    uint32_t section_offset = 0;
+    const char *section_data = NULL;
+    const struct def_record *rec = NULL;
+    struct snapshot_file entry;
+    struct snapshot_record out;
+    struct strview filename;
+
+    filename.data = file->filename;
+    filename.length = strlen(file->filename);
+
+    memset(&entry, 0, sizeof(entry));
+    entry.content_hash = file->content_hash;
+    entry.size = (uint64_t)file->st.st_size;
+    if(file->stat_cacheable) {
+        entry.inode = (uint64_t)file->st.st_ino;
+        entry.mtime_sec = (int64_t)file->st.st_mtim.tv_sec;
+        entry.mtime_nsec = (uint32_t)file->st.st_mtim.tv_nsec;
+        entry.stat_valid = 1;
+    }
+    entry.filename_offset = snapshot_add_string(writer, filename);
+    entry.filename_length = (uint32_t)filename.length;
+    entry.first_record = writer->num_records;
+    entry.num_records = (uint32_t)file->num_records;
+
+    for(i = 0; i < file->num_records; i++) {
+        rec = &file->records[i];
+        if(!section_data || rec->section.data != section_data) {
+            section_offset = snapshot_add_string(writer, rec->section);
+            section_data = rec->section.data;
+        }
+
+        memset(&out, 0, sizeof(out));
+        out.kind = rec->kind;
+        out.hash = rec->hash;
+        out.lineno = (uint32_t)rec->lineno;
+        out.section_offset = section_offset;
+        out.section_length = (uint32_t)rec->section.length;
+        out.name_offset = snapshot_add_string(writer, rec->name);
+        out.name_length = (uint32_t)rec->name.length;
+        out.value_offset = snapshot_add_string(writer, rec->value);
+        out.value_length = (uint32_t)rec->value.length;
+        defcon_buffer_append(&writer->records, (const char *)&out, sizeof(out));
+    }
+
+    defcon_buffer_append(&writer->files, (const char *)&entry, sizeof(entry));
+    writer->num_records += entry.num_records;
+    writer->num_files++;
+}
+
+/* With a snapshot, a file whose stat data didn't change isn't even
+ * opened; one that did is hashed in case only its metadata changed */
+static void load_def_file(const struct def_loader *loader, struct def_file *file)
+{
+    size_t hint = (size_t)(file - loader->files);
+
+    if(loader->hash_contents) {
+        if(stat(file->filename, &file->st) != 0) {
+            file->error = errno;
+            memset(&file->st, 0, sizeof(struct stat));
+            return;
+        }
+
+        /* Anything modified within a second of the run could
+         * still change without its mtime moving on */
+        file->stat_cacheable = S_ISREG(file->st.st_mode) && file->st.st_mtim.tv_sec + 1 < loader->started;
+        if(loader->snapshot && load_snapshot_file(loader->snapshot, hint, file, true)) {
+            file->cached = true;
+            file->stat_matched = true;
+            return;
+        }
+    }
+
+    if(!(loader->reader ? take_file(loader->reader, hint, &file->file) : map_file(file->filename, &file->file))) {
+        file->error = errno;
+        return;
+    }
+
+    if(loader->hash_contents) {
+        file->st.st_size = (off_t)file->file.size;
+        file->content_hash = hash_content(file->file.data, file->file.size);
+        if(loader->snapshot && load_snapshot_file(loader->snapshot, hint, file, false)) {
+            file->cached = true;
+            return;
+        }
+    }
+
+    ini_parse(file->file.data, file->file.size, &ini_callback_def, &ini_error_def, file);
+}
+
+static void *def_loader_thread(void *arg)
+{
+    struct def_loader *loader = arg;
+    struct def_file *file = NULL;
+
+    for(;;) {
+        pthread_mutex_lock(&loader->lock);
+        if(loader->next_file >= loader->num_files) {
+            pthread_mutex_unlock(&loader->lock);
+            break;
+        }
+
+        file = &loader->files[loader->next_file++];
+        pthread_mutex_unlock(&loader->lock);
+
+        load_def_file(loader, file);
+
+        pthread_mutex_lock(&loader->lock);
+        file->done = true;
+        pthread_cond_broadcast(&loader->file_done);
+        pthread_mutex_unlock(&loader->lock);
+    }
+
+    return NULL;
+}
+
+/* Parses the definition files on up to num_threads threads while the
+ * calling thread applies them in the order they were given, so the
+ * result is the same as parsing them one after another. With a
+ * snapshot, only files whose contents changed since it was saved
+ * are parsed and the rest are replayed from it */
+static void load_definitions(struct defcon *ctx)
+{
+    size_t i, num_files = ctx->files.count;
+    unsigned int num_threads = ctx->num_threads, num_started = 0;
+    pthread_t *threads = NULL;
+    struct def_loader loader;
+    struct def_file *file = NULL;
+    struct snapshot snapshot;
+    struct snapshot_writer *writer = &ctx->writer;
+
+    memset(&loader, 0, sizeof(loader));
+    loader.reader = ctx->use_reader ? &ctx->reader : NULL;
+    loader.hash_contents = ctx->snapshot_filename || ctx->keep_files;
+    loader.started = time(NULL);
+    if(ctx->snapshot_filename) {
+        if(open_snapshot(ctx, ctx->snapshot_filename, &snapshot))
+            loader.snapshot = &snapshot;
+        writer->changed = !loader.snapshot || snapshot.header->num_files != num_files;
+    }
+
+    loader.files = safe_malloc((num_files + 1) * sizeof(struct def_file));
+    loader.num_files = num_files;
+    memset(loader.files, 0, num_files * sizeof(struct def_file));
+    for(i = 0; i < num_files; i++)
+        loader.files[i].filename = ctx->files.names[i];
+
+    ctx->loaded_files = safe_malloc((num_files + 1) * sizeof(const char *));
+    ctx->num_loaded_files = 0;
+
+    if(num_threads > num_files)
+        num_threads = (unsigned int)num_files;
+
+    if(num_threads > 1) {
+        pthread_mutex_init(&loader.lock, NULL);
+        pthread_cond_init(&loader.file_done, NULL);
+        threads = safe_malloc(num_threads * sizeof(pthread_t));
+        while(num_started < num_threads && !pthread_create(&threads[num_started], NULL, &def_loader_thread, &loader))
+            num_started++;
+    }
+
+    for(i = 0; i < num_files; i++) {
+        file = &loader.files[i];
+
+        if(num_started) {
+            pthread_mutex_lock(&loader.lock);
+            while(!file->done)
+                pthread_cond_wait(&loader.file_done, &loader.lock);
+            pthread_mutex_unlock(&loader.lock);
+        }
+        else {
+            load_def_file(&loader, file);
+        }
+
+        if(file->error) {
+            warn(ctx, "%s: warning: %s", file->filename, strerror(file->error));
+            writer->changed = true;
+            continue;
+        }
+
+        merge_def_file(ctx, file, false);
+        ctx->loaded_files[ctx->num_loaded_files++] = file->filename;
+
+        if(ctx->snapshot_filename) {
+            if(file->cached)
+                ctx->num_cached_files++;
+            /* Rewritten for touched files too, so that next
+             * time they're recognized without reading them */
+            if(!file->cached || (!file->stat_matched && file->stat_cacheable))
+                writer->changed = true;
+            snapshot_add_file(writer, file);
+        }
+
+        if(ctx->keep_files)
+            continue;
+        free(file->records);
+        unmap_file(&file->file);
+    }
+
+    for(i = 0; i < num_started; i++)
+        pthread_join(threads[i], NULL);
+
+    if(threads) {
+        pthread_cond_destroy(&loader.file_done);
+        pthread_mutex_destroy(&loader.lock);
+        free(threads);
+    }
+
+    if(ctx->keep_files) {
+        ctx->set.files = loader.files;
+        ctx->set.num_files = num_files;
+        if((ctx->set.has_snapshot = loader.snapshot != NULL))
+            ctx->set.snapshot = snapshot;
+        return;
+    }
+
+    if(loader.snapshot)
+        close_snapshot(&snapshot);
+
+    free(loader.files);
+}
+
+static void file_list_push(struct file_list *list, const char *name)
+{
+    size_t n = strlen(name) + 1;
+
+    if(list->count >= list->capacity) {
+        list->capacity = list->capacity ? (list->capacity * 2) : 64;
+        list->names = safe_realloc(list->names, list->capacity * sizeof(char *));
+    }
+
+    list->names[list->count] = safe_malloc(n);
+    memcpy(list->names[list->count++], name, n);
+}
+
+static void file_list_free(struct file_list *list)
+{
+    size_t i;
+    for(i = 0; i < list->count; i++)
+        free(list->names[i]);
+    free(list->names);
+    memset(list, 0, sizeof(struct file_list));
+}
+
+static int compare_names(const void *a, const void *b)
+{
+    return strcmp(*(const char * const *)a, *(const char * const *)b);
+}
+
+static bool has_suffix(const char *s, const char *suffix)
+{
+    size_t n = strlen(s), suffix_length = strlen(suffix);
+    return n >= suffix_length && !strcmp(s + n - suffix_length, suffix);
+}
+
+/* Walks the tree in name order, so the definitions are
+ * merged in the same order no matter how readdir lists them */
+static void add_directory(const struct defcon *ctx, struct file_list *list, struct file_list *dirs, const char *dirname)
+{
+    DIR *dir;
+    size_t i;
+    struct dirent *entry;
+    struct stat st;
+    struct file_list names = { 0 };
+    struct defcon_buffer path = { 0 };
+
+    if(!(dir = opendir(dirname))) {
+        warn(ctx, "%s: warning: %s", dirname, strerror(errno));
+        return;
+    }
+
+    file_list_push(dirs, dirname);
+
+    while((entry = readdir(dir))) {
+        if(entry->d_name[0] != '.')
+            file_list_push(&names, entry->d_name);
+    }
+
+    closedir(dir);
+
+    if(names.count)
+        qsort(names.names, names.count, sizeof(char *), &compare_names);
+
+    for(i = 0; i < names.count; i++) {
+        defcon_buffer_clear(&path);
+        defcon_buffer_printf(&path, "%s/%s", dirname, names.names[i]);
+        if(stat(path.data, &st) != 0)
+            continue;
+        if(S_ISDIR(st.st_mode))
+            add_directory(ctx, list, dirs, path.data);
+        else if(has_suffix(names.names[i], DEFCON_FILE_SUFFIX))
+            file_list_push(list, path.data);
+    }
+
+    defcon_buffer_free(&path);
+    file_list_free(&names);
+}
+
+static void add_input(const struct defcon *ctx, struct file_list *list, struct file_list *dirs, const char *name)
+{
+    struct stat st;
+
+    if(stat(name, &st) == 0 && S_ISDIR(st.st_mode))
+        add_directory(ctx, list, dirs, name);
+    else
+        file_list_push(list, name);
+}
+
+/* Directories are searched for definition files and patterns are
+ * expanded here rather than by the shell, so trees of any size fit
+ * on the command line; anything else is taken as a file name. The
+ * directories searched are added to dirs */
+static int expand_inputs(struct defcon *ctx, struct file_list *list, struct file_list *dirs)
+{
+    size_t i, j;
+    char **args = ctx->args.names;
+    glob_t g;
+
+    for(i = 0; i < ctx->args.count; i++) {
+        if(!strpbrk(args[i], "*?[")) {
+            add_input(ctx, list, dirs, args[i]);
+            continue;
+        }
+
+        switch(glob(args[i], 0, NULL, &g)) {
+            case 0:
+                for(j = 0; j < g.gl_pathc; j++)
+                    add_input(ctx, list, dirs, g.gl_pathv[j]);
+                globfree(&g);
+                break;
+            case GLOB_NOMATCH:
+                warn(ctx, "%s: warning: no matches", args[i]);
+                break;
+            default:
+                return fail(ctx, DEFCON_ERROR_IO, "%s: glob failed", args[i]);
+        }
+    }
+
+    if(!list->count)
+        return fail(ctx, DEFCON_ERROR_INVALID, "no definition files");
+    return DEFCON_OK;
+}
+
+static void free_def_set(struct def_set *set)
+{
+    size_t i;
+
+    for(i = 0; i < set->num_files; i++) {
+        free(set->files[i].records);
+        unmap_file(&set->files[i].file);
+    }
+
+    free(set->files);
+    if(set->has_snapshot)
+        close_snapshot(&set->snapshot);
+    memset(set, 0, sizeof(struct def_set));
+}
+
+static int compare_defs(const void *a, const void *b)
+{
+    return strcmp(((const struct named_def *)a)->name, ((const struct named_def *)b)->name);
+}
+
+/* Relinks the definition list; definitions are prepended
+ * as they are loaded so it starts out in reverse order */
+static void sort_defs(struct defcon *ctx, unsigned int order)
+{
+    size_t i;
+    struct defcon_def *def = NULL, *next_def = NULL, *prev_def = NULL;
+    struct named_def *defs = NULL;
+
+    switch(order) {
+        case DEFCON_ORDER_FILE:
+            for(def = ctx->def_begin; def; def = next_def) {
+                next_def = def->next;
+                def->next = prev_def;
+                prev_def = def;
+            }
+            ctx->def_begin = prev_def;
+            break;
+        case DEFCON_ORDER_NAME:
+            if(ctx->def_count < 2)
+                break;
+            defs = safe_malloc(ctx->def_count * sizeof(struct named_def));
+            for(i = 0, def = ctx->def_begin; def; def = def->next, i++) {
+                defs[i].name = strpool_str(&ctx->pool, def->name);
+                defs[i].def = def;
+            }
+            qsort(defs, ctx->def_count, sizeof(struct named_def), &compare_defs);
+            for(i = 1; i < ctx->def_count; i++)
+                defs[i - 1].def->next = defs[i].def;
+            defs[ctx->def_count - 1].def->next = NULL;
+            ctx->def_begin = defs[0].def;
+            free(defs);
+            break;
+    }
+}
+
+static void save_defaults(struct defcon *ctx)
+{
+    struct defcon_def *def = NULL;
+    for(def = ctx->def_begin; def; def = def->next) {
+        def->default_value = def->value;
+        def->default_has_value = def->has_value;
+    }
+}
+
+static void restore_defaults(struct defcon *ctx)
+{
+    struct defcon_def *def = NULL;
+    for(def = ctx->def_begin; def; def = def->next) {
+        def->value = def->default_value;
+        def->has_value = def->default_has_value;
+    }
+}
+
+static const struct defcon_def *find_missing_value(const struct defcon *ctx)
+{
+    const struct defcon_def *def = NULL;
+    for(def = ctx->def_begin; def; def = def->next) {
+        if(!def->has_value && def->value_required)
+            return def;
+    }
+
+    return NULL;
+}
+
+/* Drops the table and everything it owns */
+static void reset_definitions(struct defcon *ctx)
+{
+    strpool_free(&ctx->pool);
+    arena_release(&ctx->arena);
+    free(ctx->def_table);
+    ctx->def_begin = NULL;
+    ctx->def_table = NULL;
+    ctx->def_table_size = 0;
+    ctx->def_count = 0;
+    ctx->keys = NULL;
+    ctx->num_keys = 0;
+    ctx->key_slots = NULL;
+    ctx->num_key_slots = 0;
+    defcon_buffer_free(&ctx->values);
+}
+
+static void make_config_key(const char *name, struct defcon_buffer *sb)
+{
+    defcon_buffer_clear(sb);
+    for(; *name; name++) {
+        if(isalpha(*name)) {
+            defcon_buffer_putc(sb, toupper(*name));
+            continue;
+        }
+
+        if(isdigit(*name)) {
+            defcon_buffer_putc(sb, *name);
+            continue;
+        }
+
+        defcon_buffer_putc(sb, '_');
+    }
+}
+
+static void value_string(const struct defcon *ctx, const struct defcon_value *src, struct defcon_buffer *sb)
+{
+    defcon_buffer_clear(sb);
+    switch(src->type) {
+        case VALUE_TYPE_STRING:
+            defcon_buffer_printf(sb, "\"%s\"", strpool_str(&ctx->pool, src->u.string));
+            break;
+        case VALUE_TYPE_INTEGER:
+            defcon_buffer_printf(sb, "%" PRIdMAX, src->u.integer);
+            break;
+        case VALUE_TYPE_HEX_INTEGER:
+            defcon_buffer_printf(sb, "0x%" PRIXMAX, src->u.unsigned_integer);
+            break;
+        case VALUE_TYPE_UNSIGNED_INTEGER:
+            defcon_buffer_printf(sb, "%" PRIuMAX, src->u.unsigned_integer);
+            break;
+        case VALUE_TYPE_BOOLEAN:
+            defcon_buffer_printf(sb, "%d", src->u.boolean ? 1 : 0);
+            break;
+        default:
+            defcon_buffer_printf(sb, "%s", strpool_str(&ctx->pool, src->u.string));
+            break;
+    }
+}
+
+
+/* Mangles every key once, in emission order, and indexes the mangled
+ * keys; if two names mangle to the same key the first one is found */
+static void render_keys(struct defcon *ctx)
+{
+    size_t i = 0, j, mask;
+    struct defcon_def *def = NULL;
+    struct rendered_key *key = NULL;
+    struct defcon_buffer config_key = { 0 };
+
+    ctx->keys = arena_alloc(&ctx->arena, ctx->def_count * sizeof(struct rendered_key));
+    ctx->num_keys = ctx->def_count;
+
+    for(def = ctx->def_begin; def; def = def->next) {
+        key = &ctx->keys[i++];
+        make_config_key(strpool_str(&ctx->pool, def->name), &config_key);
+        key->name = arena_strview(&ctx->arena, strpool_str(&ctx->pool, def->name), def->name.length);
+        key->key = arena_strview(&ctx->arena, config_key.data ? config_key.data : "", config_key.length);
+        key->value.data = NULL;
+        key->value.length = 0;
+    }
+
+    /* Keep the load factor below 3/4 */
+    for(ctx->num_key_slots = 64; ctx->num_key_slots * 3 <= ctx->num_keys * 4; ctx->num_key_slots *= 2);
+    ctx->key_slots = arena_alloc(&ctx->arena, ctx->num_key_slots * sizeof(size_t));
+    memset(ctx->key_slots, 0, ctx->num_key_slots * sizeof(size_t));
+
+    mask = ctx->num_key_slots - 1;
+    for(i = 0; i < ctx->num_keys; i++) {
+        key = &ctx->keys[i];
+        for(j = hash_string(key->key.data, key->key.length) & mask; ctx->key_slots[j]; j = (j + 1) & mask) {
+            if(view_equals(ctx->keys[ctx->key_slots[j] - 1].key, key->key.data))
+                break;
+        }
+
+        if(!ctx->key_slots[j])
+            ctx->key_slots[j] = i + 1;
+    }
+
+    defcon_buffer_free(&config_key);
+}
+
+/* Values go into a buffer of their own that's replaced every time, so
+ * resolving over and over doesn't grow the arena. The key names from
+ * render_keys stay as they are */
+static size_t render_values(struct defcon *ctx)
+{
+    size_t i, length, num_changed = 0, *offsets = NULL;
+    struct defcon_def *def = NULL;
+    struct rendered_key *key = NULL;
+    struct defcon_buffer values = { 0 }, value = { 0 };
+
+    offsets = safe_malloc((ctx->num_keys + 1) * sizeof(size_t));
+    for(i = 0, def = ctx->def_begin; def; def = def->next) {
+        value_string(ctx, &def->value, &value);
+        offsets[i++] = values.length;
+        defcon_buffer_append(&values, value.data, value.length);
+        defcon_buffer_putc(&values, 0);
+    }
+
+    offsets[i] = values.length;
+    for(i = 0; i < ctx->num_keys; i++) {
+        key = &ctx->keys[i];
+        length = offsets[i + 1] - offsets[i] - 1;
+        if(!key->value.data || key->value.length != length || memcmp(key->value.data, values.data + offsets[i], length))
+            num_changed++;
+        key->value.data = values.data + offsets[i];
+        key->value.length = length;
+    }
+
+    defcon_buffer_free(&ctx->values);
+    ctx->values = values;
+
+    defcon_buffer_free(&value);
+    free(offsets);
+    return num_changed;
+}
+
+static void render_define(const struct defcon *ctx, struct defcon_buffer *sb, const struct rendered_key *key)
+{
+    defcon_buffer_puts(sb, "#define ");
+    defcon_buffer_puts(sb, ctx->prefix);
+    defcon_buffer_append(sb, key->key.data, key->key.length);
+    defcon_buffer_putc(sb, ' ');
+    defcon_buffer_append(sb, key->value.data, key->value.length);
+    defcon_buffer_putc(sb, '\n');
+}
+
+static bool stat_changed(const struct stat *a, const struct stat *b)
+{
+    return a->st_dev != b->st_dev || a->st_ino != b->st_ino || a->st_size != b->st_size ||
+        a->st_mtim.tv_sec != b->st_mtim.tv_sec || a->st_mtim.tv_nsec != b->st_mtim.tv_nsec ||
+        a->st_ctim.tv_sec != b->st_ctim.tv_sec || a->st_ctim.tv_nsec != b->st_ctim.tv_nsec;
+}
+
+/* A file that's missing now and was missing before didn't change */
+static bool file_changed(const char *filename, const struct stat *last)
+{
+    struct stat st;
+    if(stat(filename, &st) != 0)
+        memset(&st, 0, sizeof(st));
+    return stat_changed(&st, last);
+}
+
+static struct def_file *find_kept_file(struct defcon *ctx, size_t hint, const char *filename)
+{
+    size_t i;
+    struct def_set *set = &ctx->set;
+
+    if(hint < set->num_files && set->files[hint].filename && !strcmp(set->files[hint].filename, filename))
+        return &set->files[hint];
+
+    for(i = 0; i < set->num_files; i++) {
+        if(set->files[i].filename && !strcmp(set->files[i].filename, filename))
+            return &set->files[i];
+    }
+
+    return NULL;
+}
+
+static void reload_def_file(struct def_file *file, const char *filename)
+{
+    struct def_loader loader;
+
+    memset(&loader, 0, sizeof(loader));
+    loader.files = file;
+    loader.num_files = 1;
+    loader.hash_contents = true;
+    loader.started = time(NULL);
+
+    memset(file, 0, sizeof(struct def_file));
+    file->filename = filename;
+    load_def_file(&loader, file);
+}
+
+static void free_snapshot_writer(struct snapshot_writer *writer)
+{
+    defcon_buffer_free(&writer->files);
+    defcon_buffer_free(&writer->records);
+    defcon_buffer_free(&writer->strings);
+    memset(writer, 0, sizeof(struct snapshot_writer));
+}
+
+static void stop_reader(struct defcon *ctx)
+{
+    if(ctx->use_reader)
+        stop_file_reader(&ctx->reader);
+    ctx->use_reader = false;
+    free(ctx->reader_conf);
+    ctx->reader_conf = NULL;
+}
+
+/* The table doesn't refer to the files, it stays as it is */
+static void drop_files(struct defcon *ctx)
+{
+    free_def_set(&ctx->set);
+    free(ctx->loaded_files);
+    ctx->loaded_files = NULL;
+    ctx->num_loaded_files = 0;
+}
+
+static char *copy_string(const char *s)
+{
+    size_t n = strlen(s) + 1;
+    char *copy = safe_malloc(n);
+    memcpy(copy, s, n);
+    return copy;
+}
+
+struct defcon *defcon_create(void)
+{
+    struct defcon *ctx = safe_malloc(sizeof(struct defcon));
+
+    memset(ctx, 0, sizeof(struct defcon));
+    ctx->prefix = copy_string("");
+    ctx->num_threads = 1;
+    ctx->order = DEFCON_ORDER_REVERSE;
+    return ctx;
+}
+
+void defcon_destroy(struct defcon *ctx)
+{
+    if(!ctx)
+        return;
+
+    stop_reader(ctx);
+    drop_files(ctx);
+    reset_definitions(ctx);
+    free_snapshot_writer(&ctx->writer);
+    file_list_free(&ctx->args);
+    file_list_free(&ctx->files);
+    file_list_free(&ctx->dirs);
+    defcon_buffer_free(&ctx->message);
+    free(ctx->snapshot_filename);
+    free(ctx->prefix);
+    free(ctx);
+}
+
+const char *defcon_error_message(const struct defcon *ctx)
+{
+    return ctx->message.data ? ctx->message.data : "";
+}
+
+void defcon_set_warning_handler(struct defcon *ctx, defcon_warning_handler handler, void *data)
+{
+    ctx->warning_handler = handler;
+    ctx->warning_data = data;
+}
+
+void defcon_set_prefix(struct defcon *ctx, const char *prefix)
+{
+    free(ctx->prefix);
+    ctx->prefix = copy_string(prefix);
+}
+
+const char *defcon_prefix(const struct defcon *ctx)
+{
+    return ctx->prefix;
+}
+
+void defcon_set_suppress_undefined(struct defcon *ctx, bool suppress)
+{
+    ctx->suppress_undefined = suppress;
+}
+
+void defcon_set_threads(struct defcon *ctx, unsigned int num_threads)
+{
+    ctx->num_threads = num_threads ? num_threads : 1;
+}
+
+void defcon_set_snapshot(struct defcon *ctx, const char *filename)
+{
+    free(ctx->snapshot_filename);
+    ctx->snapshot_filename = filename ? copy_string(filename) : NULL;
+}
+
+void defcon_set_file_reader(struct defcon *ctx, bool enable)
+{
+    ctx->no_reader = !enable;
+}
+
+int defcon_set_inputs(struct defcon *ctx, char *const *args, size_t num_args)
+{
+    size_t i;
+    int error;
+
+    stop_reader(ctx);
+    drop_files(ctx);
+    file_list_free(&ctx->args);
+    file_list_free(&ctx->files);
+    file_list_free(&ctx->dirs);
+
+    for(i = 0; i < num_args; i++)
+        file_list_push(&ctx->args, args[i]);
+
+    if((error = expand_inputs(ctx, &ctx->files, &ctx->dirs)) != DEFCON_OK)
+        return error;
+    if(!ctx->files.count)
+        return fail(ctx, DEFCON_ERROR_INVALID, "no definition files");
+    return DEFCON_OK;
+}
+
+const char *const *defcon_files(const struct defcon *ctx, size_t *count)
+{
+    *count = ctx->files.count;
+    return (const char *const *)ctx->files.names;
+}
+
+const char *const *defcon_dirs(const struct defcon *ctx, size_t *count)
+{
+    *count = ctx->dirs.count;
+    return (const char *const *)ctx->dirs.names;
+}
+
+int defcon_load(struct defcon *ctx, const char *input_filename, unsigned int flags)
+{
+    size_t i;
+    const char **prefetch = NULL;
+
+    if(!ctx->files.count)
+        return fail(ctx, DEFCON_ERROR_INVALID, "no definition files");
+
+    stop_reader(ctx);
+    drop_files(ctx);
+    reset_definitions(ctx);
+    free_snapshot_writer(&ctx->writer);
+    ctx->keep_files = (flags & DEFCON_KEEP_FILES) != 0;
+    ctx->num_cached_files = 0;
+
+    /* A snapshot already spares reading unchanged files */
+    if(!ctx->snapshot_filename && !ctx->no_reader) {
+        prefetch = safe_malloc((ctx->files.count + 1) * sizeof(const char *));
+        for(i = 0; i < ctx->files.count; i++)
+            prefetch[i] = ctx->files.names[i];
+        if(input_filename) {
+            ctx->reader_conf = copy_string(input_filename);
+            prefetch[i++] = ctx->reader_conf;
+        }
+
+        ctx->use_reader = start_file_reader(&ctx->reader, prefetch, i);
+        free(prefetch);
+    }
+
+    load_definitions(ctx);
+    save_defaults(ctx);
+
+    if(!ctx->reader_conf)
+        stop_reader(ctx);
+    return DEFCON_OK;
+}
+
+const char *const *defcon_loaded_files(const struct defcon *ctx, size_t *count)
+{
+    *count = ctx->num_loaded_files;
+    return ctx->loaded_files;
+}
+
+/* Parses the files that changed and, if any did or the set of files
+ * is different, merges every file again */
+int defcon_reload(struct defcon *ctx, bool *changed)
+{
+    size_t i;
+    int error;
+    bool quiet;
+    struct def_file *files = NULL, *kept = NULL;
+    struct file_list next = { 0 }, dirs = { 0 };
+
+    *changed = false;
+    if(!ctx->keep_files)
+        return fail(ctx, DEFCON_ERROR_INVALID, "the definition files weren't kept");
+
+    if((error = expand_inputs(ctx, &next, &dirs)) != DEFCON_OK) {
+        file_list_free(&next);
+        file_list_free(&dirs);
+        return error;
+    }
+
+    *changed = next.count != ctx->set.num_files;
+    files = safe_malloc((next.count + 1) * sizeof(struct def_file));
+    for(i = 0; i < next.count; i++) {
+        kept = find_kept_file(ctx, i, next.names[i]);
+        if(kept && !file_changed(next.names[i], &kept->st)) {
+            files[i] = *kept;
+            files[i].filename = next.names[i];
+            files[i].done = true;
+            kept->filename = NULL;
+            continue;
+        }
+
+        reload_def_file(&files[i], next.names[i]);
+        *changed = true;
+    }
+
+    /* Whatever wasn't taken over changed or went away */
+    for(i = 0; i < ctx->set.num_files; i++) {
+        if(!ctx->set.files[i].filename)
+            continue;
+        free(ctx->set.files[i].records);
+        unmap_file(&ctx->set.files[i].file);
+    }
+
+    free(ctx->set.files);
+    file_list_free(&ctx->files);
+    file_list_free(&ctx->dirs);
+    ctx->set.files = files;
+    ctx->set.num_files = next.count;
+    ctx->files = next;
+    ctx->dirs = dirs;
+
+    /* The names moved to the new list either way */
+    free(ctx->loaded_files);
+    ctx->loaded_files = safe_malloc((next.count + 1) * sizeof(const char *));
+    ctx->num_loaded_files = 0;
+    for(i = 0; i < next.count; i++) {
+        if(!files[i].error)
+            ctx->loaded_files[ctx->num_loaded_files++] = files[i].filename;
+    }
+
+    if(!*changed)
+        return DEFCON_OK;
+
+    reset_definitions(ctx);
+
+    /* Files taken over are marked done, the ones just parsed aren't */
+    for(i = 0; i < next.count; i++) {
+        quiet = files[i].done;
+        files[i].done = true;
+        if(files[i].error) {
+            if(!quiet)
+                warn(ctx, "%s: warning: %s", files[i].filename, strerror(files[i].error));
+            continue;
+        }
+
+        merge_def_file(ctx, &files[i], quiet);
+    }
+
+    sort_defs(ctx, ctx->order);
+    save_defaults(ctx);
+    return DEFCON_OK;
+}
+
+/* Left alone if every file came from the snapshot */
+bool defcon_take_snapshot(struct defcon *ctx, struct defcon_buffer *out)
+{
+    bool result = false;
+    struct snapshot_header header;
+    struct snapshot_writer *writer = &ctx->writer;
+
+    if(writer->changed && writer->strings.length > UINT32_MAX) {
+        warn(ctx, "%s: warning: too much data for a snapshot", ctx->snapshot_filename);
+    }
+    else if(writer->changed) {
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+        header.version = SNAPSHOT_VERSION;
+        header.num_files = writer->num_files;
+        header.num_records = writer->num_records;
+        header.strings_size = (uint32_t)writer->strings.length;
+
+        defcon_buffer_append(out, (const char *)&header, sizeof(header));
+        defcon_buffer_append(out, writer->files.data, writer->files.length);
+        defcon_buffer_append(out, writer->records.data, writer->records.length);
+        defcon_buffer_append(out, writer->strings.data, writer->strings.length);
+        result = true;
+    }
+
+    free_snapshot_writer(writer);
+    return result;
+}
+
+/* The keys are in list order, so they're rendered again */
+void defcon_sort(struct defcon *ctx, unsigned int order)
+{
+    ctx->order = order;
+    sort_defs(ctx, order);
+    ctx->keys = NULL;
+    ctx->num_keys = 0;
+    ctx->key_slots = NULL;
+    ctx->num_key_slots = 0;
+}
+
+int defcon_apply_conf(struct defcon *ctx, const char *filename)
+{
+    int error = DEFCON_OK;
+    bool prefetched = ctx->use_reader && ctx->reader_conf && !strcmp(filename, ctx->reader_conf);
+
+    if(!parse_conf_file(ctx, filename, prefetched ? &ctx->reader : NULL, ctx->files.count))
+        error = fail(ctx, DEFCON_ERROR_IO, "%s: %s", filename, strerror(errno));
+
+    /* That was the last file the reader had */
+    if(prefetched)
+        stop_reader(ctx);
+    return error;
+}
+
+int defcon_set(struct defcon *ctx, const char *name, const char *value)
+{
+    struct strview name_view, value_view;
+    struct defcon_def *def = NULL;
+
+    name_view.data = name;
+    name_view.length = strlen(name);
+    value_view.data = value;
+    value_view.length = strlen(value);
+
+    if(!(def = find_def(ctx, name_view)))
+        return fail(ctx, DEFCON_ERROR_UNDEFINED_KEY, "undefined key: %s", name);
+
+    parse_value(ctx, value_view, &def->value, &def->has_value);
+    if(!def->has_value)
+        return fail(ctx, DEFCON_ERROR_INVALID, "%s: unable to parse: %s", name, value);
+    return DEFCON_OK;
+}
+
+/* Rendering the keys leaves the values alone, the changes
+ * defcon_render counts are still the ones since last time */
+int defcon_set_key(struct defcon *ctx, const char *key, size_t length, const char *value)
+{
+    int error;
+    size_t index;
+    struct defcon_buffer name = { 0 };
+
+    if(!ctx->keys)
+        render_keys(ctx);
+    if(!defcon_find_key(ctx, key, length, &index))
+        return fail(ctx, DEFCON_ERROR_UNDEFINED_KEY, "undefined key: %.*s", (int)length, key);
+
+    /* defcon_set gets a name of its own, not one from the context it changes */
+    defcon_buffer_append(&name, ctx->keys[index].name.data, ctx->keys[index].name.length);
+    defcon_buffer_putc(&name, 0);
+    error = defcon_set(ctx, name.data, value);
+    defcon_buffer_free(&name);
+    return error;
+}
+
+void defcon_reset(struct defcon *ctx)
+{
+    restore_defaults(ctx);
+}
+
+int defcon_check(struct defcon *ctx)
+{
+    const struct defcon_def *def = find_missing_value(ctx);
+    if(def)
+        return fail(ctx, DEFCON_ERROR_REQUIRED, "key %s requires a value", strpool_str(&ctx->pool, def->name));
+    return DEFCON_OK;
+}
+
+int defcon_get(struct defcon *ctx, const char *name, struct defcon_buffer *value)
+{
+    struct strview name_view;
+    const struct defcon_def *def = NULL;
+
+    name_view.data = name;
+    name_view.length = strlen(name);
+    if(!(def = find_def(ctx, name_view)))
+        return fail(ctx, DEFCON_ERROR_UNDEFINED_KEY, "undefined key: %s", name);
+
+    value_string(ctx, &def->value, value);
+    return DEFCON_OK;
+}
+
+size_t defcon_render(struct defcon *ctx)
+{
+    if(!ctx->keys)
+        render_keys(ctx);
+    return render_values(ctx);
+}
+
+size_t defcon_num_keys(const struct defcon *ctx)
+{
+    return ctx->def_count;
+}
+
+void defcon_get_key(const struct defcon *ctx, size_t index, struct defcon_key *key)
+{
+    const struct rendered_key *src = &ctx->keys[index];
+    key->name = src->name.data;
+    key->name_length = src->name.length;
+    key->key = src->key.data;
+    key->key_length = src->key.length;
+    key->value = src->value.data;
+    key->value_length = src->value.length;
+}
+
+bool defcon_find_key(const struct defcon *ctx, const char *key, size_t length, size_t *index)
+{
+    size_t i, mask = ctx->num_key_slots - 1;
+    const struct rendered_key *found = NULL;
+
+    if(!ctx->num_key_slots)
+        return false;
+
+    for(i = hash_string(key, length) & mask; ctx->key_slots[i]; i = (i + 1) & mask) {
+        found = &ctx->keys[ctx->key_slots[i] - 1];
+        if(found->key.length == length && !memcmp(found->key.data, key, length)) {
+            *index = ctx->key_slots[i] - 1;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void defcon_format_c_header(const struct defcon *ctx, struct defcon_buffer *out)
+{
+    size_t i;
+
+    defcon_buffer_puts(out, "#ifndef __CONFIG_H__\n");
+    defcon_buffer_puts(out, "#define __CONFIG_H__ 1\n");
+    for(i = 0; i < ctx->num_keys; i++)
+        render_define(ctx, out, &ctx->keys[i]);
+    defcon_buffer_puts(out, "#endif\n");
+}
+
+void defcon_format_makefile(const struct defcon *ctx, struct defcon_buffer *out)
+{
+    size_t i;
+
+    for(i = 0; i < ctx->num_keys; i++) {
+        defcon_buffer_puts(out, ctx->prefix);
+        defcon_buffer_append(out, ctx->keys[i].key.data, ctx->keys[i].key.length);
+        defcon_buffer_puts(out, " := ");
+        defcon_buffer_append(out, ctx->keys[i].value.data, ctx->keys[i].value.length);
+        defcon_buffer_putc(out, '\n');
+    }
+}
+
+/* Only dollar signs are special in the value of a ninja variable */
+void defcon_format_ninja(const struct defcon *ctx, struct defcon_buffer *out)
+{
+    size_t i, j;
+
+    for(i = 0; i < ctx->num_keys; i++) {
+        defcon_buffer_puts(out, ctx->prefix);
+        defcon_buffer_append(out, ctx->keys[i].key.data, ctx->keys[i].key.length);
+        defcon_buffer_puts(out, " = ");
+        for(j = 0; j < ctx->keys[i].value.length; j++) {
+            if(ctx->keys[i].value.data[j] == '$')
+                defcon_buffer_putc(out, '$');
+            defcon_buffer_putc(out, ctx->keys[i].value.data[j]);
+        }
+        defcon_buffer_putc(out, '\n');
+    }
+}
+
+/* Half the slots stay empty, so a lookup rarely probes more than
+ * a couple of them no matter how many keys there are */
+bool defcon_format_index(const struct defcon *ctx, struct defcon_buffer *out)
+{
+    size_t i, pos, mask;
+    uint32_t num_slots = 1;
+    struct index_header header;
+    struct index_slot *slots = NULL, *slot = NULL;
+    struct defcon_buffer strings = { 0 };
+    const struct rendered_key *key = NULL;
+
+    while(num_slots < 2 * ctx->num_keys && num_slots < UINT32_MAX / 2)
+        num_slots *= 2;
+    if(num_slots < 2 * ctx->num_keys) {
+        warn(ctx, "warning: too many keys for an index");
+        return false;
+    }
+
+    mask = num_slots - 1;
+    slots = safe_malloc(num_slots * sizeof(struct index_slot));
+    memset(slots, 0, num_slots * sizeof(struct index_slot));
+    defcon_buffer_putc(&strings, 0);
+
+    for(i = 0; i < ctx->num_keys; i++) {
+        key = &ctx->keys[i];
+        pos = hash_string(key->name.data, key->name.length) & mask;
+        while(slots[pos].name_offset)
+            pos = (pos + 1) & mask;
+
+        slot = &slots[pos];
+        slot->hash = hash_string(key->name.data, key->name.length);
+        slot->name_offset = (uint32_t)strings.length;
+        slot->name_length = (uint32_t)key->name.length;
+        defcon_buffer_append(&strings, key->name.data, key->name.length);
+        defcon_buffer_putc(&strings, 0);
+        slot->value_offset = (uint32_t)strings.length;
+        slot->value_length = (uint32_t)key->value.length;
+        defcon_buffer_append(&strings, key->value.data, key->value.length);
+        defcon_buffer_putc(&strings, 0);
+    }
+
+    if(strings.length > UINT32_MAX) {
+        warn(ctx, "warning: too much data for an index");
+        free(slots);
+        defcon_buffer_free(&strings);
+        return false;
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+    header.version = INDEX_VERSION;
+    header.num_slots = num_slots;
+    header.num_keys = (uint32_t)ctx->num_keys;
+    header.strings_size = (uint32_t)strings.length;
+
+    defcon_buffer_append(out, (const char *)&header, sizeof(header));
+    defcon_buffer_append(out, (const char *)slots, num_slots * sizeof(struct index_slot));
+    defcon_buffer_append(out, strings.data, strings.length);
+
+    free(slots);
+    defcon_buffer_free(&strings);
+    return true;
+}
+
+void defcon_format_dump(const struct defcon *ctx, struct defcon_buffer *out)
+{
+    size_t i;
+
+    defcon_buffer_puts(out, "# This config will be parsed by defcon\n");
+    defcon_buffer_puts(out, "# without any serious problems but I'd\n");
+    defcon_buffer_puts(out, "# recommend editing it to make it readable\n");
+
+    for(i = 0; i < ctx->num_keys; i++) {
+        defcon_buffer_append(out, ctx->keys[i].name.data, ctx->keys[i].name.length);
+        defcon_buffer_puts(out, " = ");
+        defcon_buffer_append(out, ctx->keys[i].value.data, ctx->keys[i].value.length);
+        defcon_buffer_putc(out, '\n');
+    }
+}
+
+void defcon_format_define(const struct defcon *ctx, size_t index, struct defcon_buffer *out)
+{
+    render_define(ctx, out, &ctx->keys[index]);
+}
+
+static bool index_valid(const struct defcon_index *index)
+{
+    const struct index_header *header = index->header;
+
+    if(index->file.size < sizeof(struct index_header))
+        return false;
+    if(memcmp(header->magic, INDEX_MAGIC, sizeof(header->magic)) || header->version != INDEX_VERSION)
+        return false;
+    if(!header->num_slots || (header->num_slots & (header->num_slots - 1)) || !header->strings_size)
+        return false;
+    if(index->file.size != sizeof(struct index_header) + (size_t)header->num_slots * sizeof(struct index_slot) + header->strings_size)
+        return false;
+    return !index->strings[header->strings_size - 1];
+}
+
+struct defcon_index *defcon_index_open(const char *filename)
+{
+    struct defcon_index *index = safe_malloc(sizeof(struct defcon_index));
+
+    memset(index, 0, sizeof(struct defcon_index));
+    if(!map_file(filename, &index->file)) {
+        free(index);
+        return NULL;
+    }
+
+    index->header = (const struct index_header *)index->file.data;
+    if(index->file.size >= sizeof(struct index_header)) {
+        index->slots = (const struct index_slot *)(index->file.data + sizeof(struct index_header));
+        index->strings = (const char *)(index->slots + index->header->num_slots);
+    }
+
+    if(!index_valid(index)) {
+        defcon_index_close(index);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    return index;
+}
+
+void defcon_index_close(struct defcon_index *index)
+{
+    if(index) {
+        unmap_file(&index->file);
+        free(index);
+    }
+}
+
+/* The slots aren't checked up front, opening an index doesn't
+ * depend on its size; a broken one just doesn't find anything */
+bool defcon_index_get(const struct defcon_index *index, const char *name, size_t length, const char **value, size_t *value_length)
+{
+    uint32_t i, hash = hash_string(name, length);
+    uint32_t mask = index->header->num_slots - 1;
+    uint32_t strings_size = index->header->strings_size;
+    const struct index_slot *slot = NULL;
+
+    for(i = 0; i < index->header->num_slots; i++) {
+        slot = &index->slots[(hash + i) & mask];
+        if(!slot->name_offset)
+            return false;
+        if(slot->hash != hash || slot->name_length != length)
+            continue;
+        if(slot->name_offset >= strings_size || length >= strings_size - slot->name_offset)
+            return false;
+        if(memcmp(index->strings + slot->name_offset, name, length))
+            continue;
+        if(slot->value_offset >= strings_size || slot->value_length >= strings_size - slot->value_offset)
+            return false;
+
+        *value = index->strings + slot->value_offset;
+        *value_length = slot->value_length;
+        return true;
+    }
+
+    return false;
+}
+
+void defcon_get_stats(const struct defcon *ctx, struct defcon_stats *stats)
+{
+    stats->num_defs = ctx->def_count;
+    stats->table_size = ctx->def_table_size;
+    stats->num_lookups = ctx->num_lookups;
+    stats->num_probes = ctx->num_probes;
+    stats->num_strings = ctx->pool.count;
+    stats->string_bytes = ctx->pool.buffer.length;
+    stats->num_files = ctx->num_loaded_files;
+    stats->num_cached_files = ctx->num_cached_files;
+}
@@ -0,0 +1,96 @@
+#!/bin/sh
+#
+# Regression checks for the defcon binary given as the first argument.
+# `make check` runs them; build with CFLAGS="-g -fsanitize=address,undefined"
+# first to have memory errors fail the run as well.
+#
+
+set -e
+
+DEFCON=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+cd "$WORK"
+
+fail()
+{
+    echo "FAIL: $*" >&2
+    exit 1
+}
+
+# <count>: string definitions s0..s<count-1>
+gen_defs()
+{
+    awk -v n="$1" 'BEGIN { for(i = 0; i < n; i++) printf("[s%d]\ntype = string\nvalue = default%d\n", i, i) }'
+}
+
+# <count> <char> <length> <step>: every <step>th value is <length>
+# times <char>, the others 2048 times 'a'
+gen_conf()
+{
+    awk -v n="$1" -v c="$2" -v len="$3" -v step="$4" 'BEGIN {
+        for(i = 0; i < n; i++) {
+            s = ""
+            if(i % step)
+                for(j = 0; j < 2048; j++) s = s "a"
+            else
+                for(j = 0; j < len; j++) s = s c
+            printf("s%d = %s%d\n", i, s, i)
+        }
+    }'
+}
+
+# -x resolves both input files against one table; the second one
+# interns enough to move the string pool under the first one's keys
+check_diff()
+{
+    gen_defs 200 > strings.def
+    gen_conf 200 a 2048 1 > a.conf
+    gen_conf 200 b 8192 4 > b.conf
+
+    "$DEFCON" -j1 -c a.conf -x b.conf -X strings.def > changed
+    [ "$(wc -l < changed)" -eq 50 ] || fail "-x -X: expected 50 changed keys"
+    "$DEFCON" -j1 -c a.conf -x b.conf strings.def > diff
+    [ "$(grep -c '^+s[0-9]* = "b' diff)" -eq 50 ] || fail "-x: expected 50 changed values"
+    echo "ok: -x"
+}
+
+# Polls for up to five seconds until the command succeeds
+wait_until()
+{
+    i=0
+    while ! "$@" > /dev/null 2>&1; do
+        i=$((i + 1))
+        [ $i -lt 50 ] || return 1
+        sleep 0.1
+    done
+}
+
+# -w keeps the rendered keys across changes to the input file while
+# the new values intern strings; the index must still have every name
+check_watch_index()
+{
+    [ "$(uname)" = Linux ] || return 0
+
+    gen_defs 200 > strings.def
+    gen_conf 200 a 2048 1 > watch.conf
+
+    "$DEFCON" -w -j1 -c watch.conf -i watch.idx strings.def 2> watch.log &
+    pid=$!
+    wait_until test -f watch.idx || fail "-w -i: no index written"
+
+    gen_conf 200 b 8192 4 > watch.new
+    mv watch.new watch.conf
+    wait_until sh -c "'$DEFCON' -i watch.idx -q s0 | grep -q '^\"b'" || fail "-w -i: index not updated"
+
+    awk 'BEGIN { for(i = 0; i < 200; i++) print "s" i }' | "$DEFCON" -i watch.idx -q > values ||
+        fail "-w -i: names missing from the index"
+    [ "$(grep -c '^"b' values)" -eq 50 ] && [ "$(grep -c '^"a' values)" -eq 150 ] || fail "-w -i: wrong values"
+
+    kill $pid
+    wait $pid || fail "-w -i: session didn't end cleanly"
+    echo "ok: -w -i"
+}
+
+check_diff
+check_watch_index